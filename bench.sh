@@ -0,0 +1,60 @@
+#!/bin/sh
+#
+# bench.sh, time c64koala2ppm on random Koala files
+# Copyright 2009 Christopher Williams
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License
+# as published by the Free Software Foundation; either version 2
+# of the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# Usage: ./bench.sh [files]
+#
+# Generates that many random Koala files (2000 by default) and converts them
+# in each mode, reporting the time and files per second c64koala2ppm -v
+# measures for the conversion itself. Random bitmaps are a worst case for
+# the formats that compress.
+
+files=${1:-2000}
+prog=./c64koala2ppm
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+mkdir "$dir/in" "$dir/out" || exit 1
+
+# a Koala file is 10003 bytes
+head -c $((files * 10003)) /dev/urandom |
+	(cd "$dir/in" && split -a 4 -b 10003 - k) || exit 1
+ls "$dir"/in/* > "$dir/list"
+
+# run label [options...]: convert every file with these options
+run() {
+	label=$1
+	shift
+	printf '%-24s ' "$label"
+	"$prog" -v "$@" -f "$dir/list" 2>&1 >/dev/null |
+		sed -n -e 's/^.*: total: //p' -e 's/^.*: io_uring: //p'
+}
+
+echo "$files files, $(getconf _NPROCESSORS_ONLN) CPUs"
+run "stdout, 1 thread" -j 1
+run "stdout"
+run "files, 1 thread" -j 1 -o "$dir/out/%n.ppm"
+run "files" -o "$dir/out/%n.ppm"
+run "files, streamed" -S -o "$dir/out/%n.ppm"
+run "files, io_uring" -u -o "$dir/out/%n.ppm"
+for format in pam png qoi raw bmp gif; do
+	run "$format" -j 1 -F $format
+done
+run "png best" -j 1 -F png -z best
+run "ppm -x 2" -j 1 -x 2
+run "ppm -x 8" -j 1 -x 8
+run "ppm -a" -j 1 -a
+run "ppm -a -x 2 -c" -j 1 -a -x 2 -c
+run "ppm -b 0" -j 1 -b 0
+run "ppm -t 40x25" -j 1 -t 40x25
+run "four palettes" -j 1 -p default,pepto,colodore,vice
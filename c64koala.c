@@ -0,0 +1,2112 @@
+/*
+
+$Id$
+
+libc64koala, decode Commodore 64 KoalaPaint images
+Copyright 2009 Christopher Williams
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "c64koala.h"
+#include "deflate.h"
+
+#ifndef C64KOALA_NO_DEFAULT_PALETTE
+/* default_palette[], generated by mkpalette at build time */
+#include "c64koala_palette.h"
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+/*
+ * The Commodore 64 version of Koala Painter used a fairly simple file format:
+ * A two-byte load address, followed immediately by
+ * 8000 bytes of raw bitmap data,
+ * 1000 bytes of raw "Video Matrix" data,
+ * 1000 bytes of raw "Color RAM" data,
+ * and a one-byte Background Color field.
+ *
+ * The screen is divided into 4x8 pixel areas called "cards". Cards are arranged
+ * left-to-right, top-to-bottom, in row-major order.
+ *
+ * The video matrix data is arranged in card order, with one byte per card.
+ * Each byte defines two colors that can be used in that card, one in the high
+ * nibble, and one in the low nibble.
+ *
+ * The color RAM is similar to the video matrix data, except that each byte
+ * contains only one color that can be used in that card. Only the low nibble
+ * is used.
+ *
+ * The bitmap data is arranged in card order, such that it fills up one card at
+ * a time. Each byte of bitmap data consists of four two-bit pixels, with each
+ * pixel being one of 4 colors:
+ *    00: global background color
+ *    01: upper nibble of video RAM for this card
+ *    10: lower nibble of video RAM for this card
+ *    11: lower nibble of color RAM for this card
+ */
+
+/* http://www.pepto.de/projects/colorvic/ defines both USCALE and VSCALE
+ * as 34.0081334493 / 255 (0.13337)
+ * it also uses the following formula to convert YUV to RGB:
+ * R = Y             + 1,140 * V
+ * G = Y - 0,396 * U - 0,581 * V
+ * B = Y + 2,029 * U
+ *
+ * while I'm using this formula from wikipedia:
+ * R = Y               + 1.13983 * V
+ * G = Y - 0.39465 * U - 0.58060 * V
+ * B = Y + 2.03211 * U
+ */
+#define USCALE C64KOALA_USCALE
+#define VSCALE C64KOALA_VSCALE
+
+/* colors are from http://www.pepto.de/projects/colorvic/ */
+static const struct c64_color {
+	 /* angle is [0..15], luma is [0..32], saturation is [0..1] */
+	int angle, luma, saturation;
+} c64_colors[16] = {
+	{  0,  0, 0 }, /* black */
+	{  0, 32, 0 }, /* white */
+
+	{  5, 10, 1 }, /* red */
+	{ 13, 20, 1 }, /* cyan */
+
+	{  2, 12, 1 }, /* purple */
+	{ 10, 16, 1 }, /* green */
+
+	{  0,  8, 1 }, /* blue */
+	{  8, 24, 1 }, /* yellow */
+
+	{  6, 12, 1 }, /* orange */
+	{  7,  8, 1 }, /* brown */
+	{  5, 16, 1 }, /* light red */
+	{  0, 10, 0 }, /* dark grey */
+	{  0, 15, 0 }, /* grey */
+	{ 10, 24, 1 }, /* light green */
+	{  0, 15, 1 }, /* light blue */
+	{  0, 20, 0 }, /* light grey */
+};
+
+/* note: the y component in yuv_color is luma (Y'), which is gamma-compressed */
+struct yuv_color {
+	float y, u, v;
+};
+
+/* cos(angle*pi/8); sin(angle*pi/8) is cos((angle-4)*pi/8) */
+static const double angle_cos[16] = {
+	 1.0,                  0.92387953251128674,  0.70710678118654757,
+	 0.38268343236508984,  0.0,                 -0.38268343236508984,
+	-0.70710678118654757, -0.92387953251128674, -1.0,
+	-0.92387953251128674, -0.70710678118654757, -0.38268343236508984,
+	 0.0,                  0.38268343236508984,  0.70710678118654757,
+	 0.92387953251128674
+};
+
+static void c64_to_yuv(const struct c64_color *c64, struct yuv_color *yuv,
+                       float saturation, float uscale, float vscale)
+{
+	yuv->y = c64->luma / 32.;
+	yuv->u = c64->saturation * saturation * uscale * angle_cos[c64->angle];
+	yuv->v = c64->saturation * saturation * vscale *
+	         angle_cos[(c64->angle + 12) % 16];
+}
+
+/*
+ * A YUV model gives the coefficients of
+ * R = Y           + rv * V
+ * G = Y + gu * U + gv * V
+ * B = Y + bu * U
+ */
+struct yuv_model {
+	double rv, gu, gv, bu;
+};
+
+/* from http://en.wikipedia.org/wiki/YUV */
+static const struct yuv_model wikipedia_yuv = {
+	1.13983, -0.39465, -0.58060, 2.03211
+};
+
+/* from http://www.pepto.de/projects/colorvic/ */
+static const struct yuv_model pepto_yuv = {
+	1.140, -0.396, -0.581, 2.029
+};
+
+static void yuv_to_rgb(const struct yuv_model *model, struct yuv_color *yuv,
+                       struct c64koala_rgb *rgb)
+{
+	float r,g,b;
+	r = (yuv->y +                        model->rv * yuv->v);
+	g = (yuv->y + model->gu * yuv->u + model->gv * yuv->v);
+	b = (yuv->y + model->bu * yuv->u);
+	
+#define BOUND(x) do {                      \
+if (x < 0) {                               \
+	x = 0;                             \
+	/*fprintf(stderr, #x " < 0!\n");*/ \
+} else if (x > 1) {                        \
+	x = 1;                             \
+	/*fprintf(stderr, #x " > 1!\n");*/ \
+}} while (0)
+
+	BOUND(r);
+	BOUND(g);
+	BOUND(b);
+	rgb->r = 255*r + 0.5;
+	rgb->g = 255*g + 0.5;
+	rgb->b = 255*b + 0.5;
+}
+
+static void c64_to_rgb(const struct c64_color *c64, struct c64koala_rgb *rgb,
+                       float saturation, float uscale, float vscale)
+{
+	struct yuv_color yuv;
+	c64_to_yuv(c64, &yuv, saturation, uscale, vscale);
+	yuv_to_rgb(&wikipedia_yuv, &yuv, rgb);
+}
+
+/*
+ * Change the saturation of an RGB color made with the given YUV model. Only U
+ * and V are scaled, which moves each of R, G and B towards or away from Y by
+ * the same factor, so all that is needed is Y. Solving the model for it:
+ * Y = (G - gu/bu * B - gv/rv * R) / (1 - gu/bu - gv/rv)
+ */
+static void saturate_rgb(const struct yuv_model *model,
+                         const struct c64koala_rgb *in,
+                         struct c64koala_rgb *out, float saturation)
+{
+	double kb = model->gu / model->bu, kr = model->gv / model->rv;
+	float y, r, g, b;
+	
+	y = (in->g - kb * in->b - kr * in->r) / (1 - kb - kr) / 255;
+	r = y + saturation * (in->r / 255. - y);
+	g = y + saturation * (in->g / 255. - y);
+	b = y + saturation * (in->b / 255. - y);
+	BOUND(r);
+	BOUND(g);
+	BOUND(b);
+	out->r = 255*r + 0.5;
+	out->g = 255*g + 0.5;
+	out->b = 255*b + 0.5;
+}
+
+/*
+ * Palette presets other than the default are fixed RGB tables, along with the
+ * YUV model they were made with for changing their saturation.
+ */
+
+/* http://www.pepto.de/projects/colorvic/2001/ */
+static const struct c64koala_rgb pepto_rgb[16] = {
+	{ 0x00, 0x00, 0x00 }, { 0xff, 0xff, 0xff },
+	{ 0x68, 0x37, 0x2b }, { 0x70, 0xa4, 0xb2 },
+	{ 0x6f, 0x3d, 0x86 }, { 0x58, 0x8d, 0x43 },
+	{ 0x35, 0x28, 0x79 }, { 0xb8, 0xc7, 0x6f },
+	{ 0x6f, 0x4f, 0x25 }, { 0x43, 0x39, 0x00 },
+	{ 0x9a, 0x67, 0x59 }, { 0x44, 0x44, 0x44 },
+	{ 0x6c, 0x6c, 0x6c }, { 0x9a, 0xd2, 0x84 },
+	{ 0x6c, 0x5e, 0xb5 }, { 0x95, 0x95, 0x95 },
+};
+
+/* http://www.colodore.com/ at its default settings */
+static const struct c64koala_rgb colodore_rgb[16] = {
+	{ 0x00, 0x00, 0x00 }, { 0xff, 0xff, 0xff },
+	{ 0x81, 0x33, 0x38 }, { 0x75, 0xce, 0xc8 },
+	{ 0x8e, 0x3c, 0x97 }, { 0x56, 0xac, 0x4d },
+	{ 0x2e, 0x2c, 0x9b }, { 0xed, 0xf1, 0x71 },
+	{ 0x8e, 0x50, 0x29 }, { 0x55, 0x38, 0x00 },
+	{ 0xc4, 0x6c, 0x71 }, { 0x4a, 0x4a, 0x4a },
+	{ 0x7b, 0x7b, 0x7b }, { 0xa9, 0xff, 0x9f },
+	{ 0x70, 0x6d, 0xeb }, { 0xb2, 0xb2, 0xb2 },
+};
+
+/* the old default palette of the VICE emulator */
+static const struct c64koala_rgb vice_rgb[16] = {
+	{ 0x00, 0x00, 0x00 }, { 0xfd, 0xfe, 0xfc },
+	{ 0xbe, 0x1a, 0x24 }, { 0x30, 0xe6, 0xc6 },
+	{ 0xb4, 0x1a, 0xe2 }, { 0x1f, 0xd2, 0x1e },
+	{ 0x21, 0x1b, 0xae }, { 0xdf, 0xf6, 0x0a },
+	{ 0xb8, 0x41, 0x04 }, { 0x6a, 0x33, 0x04 },
+	{ 0xfe, 0x4a, 0x57 }, { 0x42, 0x45, 0x40 },
+	{ 0x70, 0x74, 0x6f }, { 0x59, 0xfe, 0x59 },
+	{ 0x5f, 0x53, 0xfe }, { 0xa4, 0xa7, 0xa2 },
+};
+
+static const struct preset {
+	const char *name;
+	const struct c64koala_rgb *rgb; /* NULL to compute it from c64_colors */
+	const struct yuv_model *yuv;
+} presets[C64KOALA_NPRESETS] = {
+	{ "default",  NULL,         &wikipedia_yuv },
+	{ "pepto",    pepto_rgb,    &pepto_yuv },
+	{ "colodore", colodore_rgb, &pepto_yuv },
+	{ "vice",     vice_rgb,     &wikipedia_yuv },
+};
+
+/*
+ * A card decoder expands the 8 bitmap bytes of one card into 8 rows of 4
+ * pixels, stride bytes apart, each pixel being the C64 color index taken from
+ * the card's 4-entry palette pal[].
+ */
+
+/* ctx->slots[c][i] is the color slot (0..3) of pixel i, counting from the
+ * left, of bitmap byte c */
+static void decode_card_scalar(const struct c64koala_ctx *ctx,
+                               const unsigned char *bits,
+                               const unsigned char *pal,
+                               unsigned char *out, size_t stride)
+{
+	int y;
+	for (y = 0; y < 8; ++y) {
+		const unsigned char *slot = ctx->slots[bits[y]];
+		out[0] = pal[slot[0]];
+		out[1] = pal[slot[1]];
+		out[2] = pal[slot[2]];
+		out[3] = pal[slot[3]];
+		out += stride;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * The SIMD decoders split each bitmap byte into its high and low nibble. A
+ * nibble holds two pixels, so two 16-entry pshufb tables map it straight to
+ * colors: pal_hi[n] = pal[n>>2] for the left pixel and pal_lo[n] = pal[n&3]
+ * for the right one. Every nibble is duplicated so that even output bytes
+ * look up pal_hi and odd output bytes look up pal_lo.
+ */
+
+/* store the 4 rows of 4 pixels held in c */
+__attribute__((target("sse2")))
+static void store_card_rows(__m128i c, unsigned char *out, size_t stride)
+{
+	int i, row;
+	for (i = 0; i < 4; ++i) {
+		row = _mm_cvtsi128_si32(c);
+		memcpy(out, &row, 4);
+		c = _mm_srli_si128(c, 4);
+		out += stride;
+	}
+}
+
+__attribute__((target("ssse3")))
+static void decode_card_ssse3(const struct c64koala_ctx *ctx,
+                              const unsigned char *bits,
+                              const unsigned char *pal,
+                              unsigned char *out, size_t stride)
+{
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m128i odd = _mm_set1_epi16((short)0xff00);
+	__m128i p, pal_hi, pal_lo, v, n, n0, n1, c0, c1;
+
+	(void)ctx; /* only the scalar decoder uses the slot table */
+
+	p = _mm_cvtsi32_si128(pal[0] | pal[1] << 8 | pal[2] << 16 | pal[3] << 24);
+	pal_hi = _mm_shuffle_epi8(p, _mm_setr_epi8(0, 0, 0, 0, 1, 1, 1, 1,
+	                                           2, 2, 2, 2, 3, 3, 3, 3));
+	pal_lo = _mm_shuffle_epi8(p, _mm_setr_epi8(0, 1, 2, 3, 0, 1, 2, 3,
+	                                           0, 1, 2, 3, 0, 1, 2, 3));
+
+	v = _mm_loadl_epi64((const __m128i *)bits);
+	/* hi0 lo0 hi1 lo1 ... hi7 lo7 */
+	n = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(v, 4), nibble),
+	                      _mm_and_si128(v, nibble));
+	/* hi0 hi0 lo0 lo0 ... for rows 0-3 and rows 4-7 */
+	n0 = _mm_unpacklo_epi8(n, n);
+	n1 = _mm_unpackhi_epi8(n, n);
+
+	c0 = _mm_or_si128(_mm_andnot_si128(odd, _mm_shuffle_epi8(pal_hi, n0)),
+	                  _mm_and_si128(odd, _mm_shuffle_epi8(pal_lo, n0)));
+	c1 = _mm_or_si128(_mm_andnot_si128(odd, _mm_shuffle_epi8(pal_hi, n1)),
+	                  _mm_and_si128(odd, _mm_shuffle_epi8(pal_lo, n1)));
+	store_card_rows(c0, out, stride);
+	store_card_rows(c1, out + 4*stride, stride);
+}
+
+/* same as decode_card_ssse3(), but the whole card fits in one register */
+__attribute__((target("avx2")))
+static void decode_card_avx2(const struct c64koala_ctx *ctx,
+                             const unsigned char *bits,
+                             const unsigned char *pal,
+                             unsigned char *out, size_t stride)
+{
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m256i odd = _mm256_set1_epi16((short)0xff00);
+	__m128i p, v, n;
+	__m256i pal_hi, pal_lo, w, c;
+
+	(void)ctx; /* only the scalar decoder uses the slot table */
+
+	p = _mm_cvtsi32_si128(pal[0] | pal[1] << 8 | pal[2] << 16 | pal[3] << 24);
+	pal_hi = _mm256_broadcastsi128_si256(
+	        _mm_shuffle_epi8(p, _mm_setr_epi8(0, 0, 0, 0, 1, 1, 1, 1,
+	                                          2, 2, 2, 2, 3, 3, 3, 3)));
+	pal_lo = _mm256_broadcastsi128_si256(
+	        _mm_shuffle_epi8(p, _mm_setr_epi8(0, 1, 2, 3, 0, 1, 2, 3,
+	                                          0, 1, 2, 3, 0, 1, 2, 3)));
+
+	v = _mm_loadl_epi64((const __m128i *)bits);
+	n = _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(v, 4), nibble),
+	                      _mm_and_si128(v, nibble));
+	w = _mm256_cvtepu8_epi16(n);
+	w = _mm256_or_si256(w, _mm256_slli_epi16(w, 8));
+
+	c = _mm256_blendv_epi8(_mm256_shuffle_epi8(pal_hi, w),
+	                       _mm256_shuffle_epi8(pal_lo, w), odd);
+	store_card_rows(_mm256_castsi256_si128(c), out, stride);
+	store_card_rows(_mm256_extracti128_si256(c, 1), out + 4*stride, stride);
+}
+#endif
+
+int c64koala_find_preset(const char *name)
+{
+	int i;
+	for (i = 0; i < C64KOALA_NPRESETS; ++i)
+		if (!strcmp(presets[i].name, name))
+			return i;
+	return -1;
+}
+
+const char *c64koala_preset_name(int preset)
+{
+	return presets[preset].name;
+}
+
+void c64koala_make_palette(struct c64koala_palette *palette,
+                           const struct c64koala_colors *colors)
+{
+	const struct preset *preset = &presets[colors->preset];
+	int i;
+	
+	palette->colors = *colors;
+	if (preset->rgb) {
+		for (i = 0; i < 16; ++i)
+			saturate_rgb(preset->yuv, &preset->rgb[i], &palette->rgb[i],
+			             colors->saturation);
+		return;
+	}
+#ifndef C64KOALA_NO_DEFAULT_PALETTE
+	if (colors->saturation == (float)C64KOALA_SATURATION &&
+	    colors->uscale == (float)C64KOALA_USCALE &&
+	    colors->vscale == (float)C64KOALA_VSCALE) {
+		memcpy(palette->rgb, default_palette, sizeof(palette->rgb));
+		return;
+	}
+#endif
+	for (i = 0; i < 16; ++i)
+		c64_to_rgb(&c64_colors[i], &palette->rgb[i], colors->saturation,
+		           colors->uscale, colors->vscale);
+}
+
+void c64koala_palette_cache_init(struct c64koala_palette_cache *cache)
+{
+	memset(cache, 0, sizeof(*cache));
+	pthread_mutex_init(&cache->lock, NULL);
+}
+
+void c64koala_palette_cache_destroy(struct c64koala_palette_cache *cache)
+{
+	pthread_mutex_destroy(&cache->lock);
+}
+
+static int same_colors(const struct c64koala_colors *a,
+                       const struct c64koala_colors *b)
+{
+	return a->preset == b->preset && a->saturation == b->saturation &&
+	       a->uscale == b->uscale && a->vscale == b->vscale;
+}
+
+const struct c64koala_palette *
+c64koala_palette_get(struct c64koala_palette_cache *cache,
+                     const struct c64koala_colors *colors)
+{
+	int i, victim = -1;
+	const struct c64koala_palette *palette = NULL;
+	
+	pthread_mutex_lock(&cache->lock);
+	for (i = 0; i < C64KOALA_PALETTE_CACHE_SIZE; ++i) {
+		if (cache->slots[i].valid &&
+		    same_colors(&cache->slots[i].palette.colors, colors))
+			break;
+		/* unused slots have never been used, so they go first */
+		if (!cache->slots[i].refs && (victim < 0 ||
+		    cache->slots[i].last_used < cache->slots[victim].last_used))
+			victim = i;
+	}
+	if (i < C64KOALA_PALETTE_CACHE_SIZE) {
+		++cache->hits;
+	} else if (victim >= 0) {
+		/* not cached; evict the least recently used palette nobody holds */
+		++cache->misses;
+		i = victim;
+		c64koala_make_palette(&cache->slots[i].palette, colors);
+		cache->slots[i].valid = 1;
+	}
+	if (i < C64KOALA_PALETTE_CACHE_SIZE) {
+		++cache->slots[i].refs;
+		cache->slots[i].last_used = ++cache->clock;
+		palette = &cache->slots[i].palette;
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return palette;
+}
+
+void c64koala_palette_cache_stats(struct c64koala_palette_cache *cache,
+                                  unsigned long *hits, unsigned long *misses)
+{
+	pthread_mutex_lock(&cache->lock);
+	*hits = cache->hits;
+	*misses = cache->misses;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void c64koala_palette_release(struct c64koala_palette_cache *cache,
+                              const struct c64koala_palette *palette)
+{
+	int i;
+	pthread_mutex_lock(&cache->lock);
+	for (i = 0; i < C64KOALA_PALETTE_CACHE_SIZE; ++i)
+		if (palette == &cache->slots[i].palette)
+			--cache->slots[i].refs;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void c64koala_init(struct c64koala_ctx *ctx)
+{
+	int c, i;
+	
+	for (c = 0; c < 256; ++c)
+		for (i = 0; i < 4; ++i)
+			ctx->slots[c][i] = (c >> (6 - 2*i)) & 03;
+	
+	ctx->decode_card = decode_card_scalar;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		ctx->decode_card = decode_card_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		ctx->decode_card = decode_card_ssse3;
+#endif
+}
+
+void c64koala_mark_short(struct c64koala *koala)
+{
+	memset(koala->bitmap, 0x1b, sizeof(koala->bitmap));
+	memset(koala->video, 0x25, sizeof(koala->video));
+	memset(koala->color, 0x06, sizeof(koala->color));
+	koala->bg = 0x00;
+}
+
+void c64koala_decode_card_row(const struct c64koala_ctx *ctx,
+                              const struct c64koala *koala, int cardy,
+                              unsigned char rows[8][C64KOALA_WIDTH])
+{
+	unsigned char pal[4];
+	int cardx;
+	
+	pal[0] = koala->bg & 0x0f;
+	
+	for (cardx = 0; cardx < 40; ++cardx) {
+		/* 1 = upper nibble of video ram */
+		pal[1] = (koala->video[cardy][cardx]>>4) & 0x0f;
+		/* 2 = lower nibble of video ram */
+		pal[2] = (koala->video[cardy][cardx]) & 0x0f;
+		/* 3 = color ram */
+		pal[3] = (koala->color[cardy][cardx]) & 0x0f;
+		
+		ctx->decode_card(ctx, koala->bitmap[cardy][cardx], pal,
+		                 &rows[0][4*cardx], C64KOALA_WIDTH);
+	}
+}
+
+/*
+ * Resolving the indices to RGB is left to c64koala_render_rgb(), so the same
+ * decoded image can be rendered with any palette, or written out as indices.
+ */
+void c64koala_decode(const struct c64koala_ctx *ctx,
+                     const struct c64koala *koala,
+                     unsigned char image[C64KOALA_HEIGHT][C64KOALA_WIDTH])
+{
+	int cardy;
+	for (cardy = 0; cardy < 25; ++cardy)
+		c64koala_decode_card_row(ctx, koala, cardy, &image[8*cardy]);
+}
+
+void c64koala_render_rgb(const struct c64koala_palette *palette,
+                         const unsigned char image[][C64KOALA_WIDTH],
+                         int nrows,
+                         struct c64koala_rgb out[][C64KOALA_WIDTH])
+{
+	int x, y;
+	for (y = 0; y < nrows; ++y)
+		for (x = 0; x < C64KOALA_WIDTH; ++x)
+			out[y][x] = palette->rgb[image[y][x]];
+}
+
+/* write a PPM header, and a terminating NUL, to buf */
+static size_t ppm_header(char *buf, int width, int height)
+{
+	return sprintf(buf, "P6\n"
+	                    "%d %d\n"
+	                    "%d\n", width, height, 255);
+}
+
+size_t c64koala_to_ppm(const struct c64koala_ctx *ctx,
+                       const struct c64koala_palette *palette,
+                       const struct c64koala *koala, unsigned char *buf)
+{
+	return c64koala_to_ppms(ctx, &palette, 1, koala, &buf);
+}
+
+size_t c64koala_to_ppms(const struct c64koala_ctx *ctx,
+                        const struct c64koala_palette *const palettes[],
+                        int npalettes, const struct c64koala *koala,
+                        unsigned char *const bufs[])
+{
+	unsigned char rows[8][C64KOALA_WIDTH];
+	struct c64koala_rgb (*out)[C64KOALA_WIDTH];
+	size_t len = 0;
+	int cardy, i;
+	
+	/* the pixels are rendered straight into the bufs, after the header */
+	for (i = 0; i < npalettes; ++i)
+		len = ppm_header((char *)bufs[i], C64KOALA_WIDTH, C64KOALA_HEIGHT);
+	for (cardy = 0; cardy < 25; ++cardy) {
+		c64koala_decode_card_row(ctx, koala, cardy, rows);
+		for (i = 0; i < npalettes; ++i) {
+			out = (struct c64koala_rgb (*)[C64KOALA_WIDTH])(bufs[i] + len);
+			c64koala_render_rgb(palettes[i], rows, 8, &out[8*cardy]);
+		}
+	}
+	return len + sizeof(struct c64koala_rgb[C64KOALA_HEIGHT][C64KOALA_WIDTH]);
+}
+
+int c64koala_stream_ppm(const struct c64koala_ctx *ctx,
+                        const struct c64koala_palette *palette,
+                        const struct c64koala *koala, FILE *outfile)
+{
+	struct c64koala_output output;
+	output.format = C64KOALA_FORMAT_PPM;
+	output.scale = 1;
+	output.wide = 0;
+	output.level = C64KOALA_LEVEL_FAST;
+	output.thumb = C64KOALA_THUMB_NONE;
+	output.crt = 0;
+	output.border = C64KOALA_BORDER_NONE;
+	output.palette = palette;
+	return c64koala_stream_image(ctx, &output, koala, outfile);
+}
+
+/* whether output has the picture in a frame */
+static int framed(const struct c64koala_output *output)
+{
+	return output->border != C64KOALA_BORDER_NONE &&
+	       (output->format == C64KOALA_FORMAT_PPM ||
+	        output->format == C64KOALA_FORMAT_PAM);
+}
+
+/* how many times over each pixel is written across; down, it is scale */
+#define MAX_XSCALE (2 * C64KOALA_MAX_SCALE)
+
+static int xscale(const struct c64koala_output *output)
+{
+	return output->wide || framed(output) ? 2 * output->scale : output->scale;
+}
+
+/*
+ * The border a PAL TV shows around the picture, in C64 pixels. There are
+ * two more lines of it below the picture than above.
+ */
+#define BORDER_LEFT ((C64KOALA_FRAME_WIDTH - 2 * C64KOALA_WIDTH) / 2)
+#define BORDER_TOP ((C64KOALA_FRAME_HEIGHT - C64KOALA_HEIGHT) / 2 - 1)
+#define BORDER_BOTTOM (C64KOALA_FRAME_HEIGHT - C64KOALA_HEIGHT - BORDER_TOP)
+
+static int output_width(const struct c64koala_output *output)
+{
+	return framed(output) ? C64KOALA_FRAME_WIDTH * output->scale :
+	                        C64KOALA_WIDTH * xscale(output);
+}
+
+static int output_height(const struct c64koala_output *output)
+{
+	return framed(output) ? C64KOALA_FRAME_HEIGHT * output->scale :
+	                        C64KOALA_HEIGHT * output->scale;
+}
+
+/*
+ * What render_row() needs to resolve color indices to one palette's RGB.
+ * spans[] holds each color's RGB eight times over. A pixel written n times
+ * across is then a copy of the first 3n bytes of its span, done in whole 8,
+ * 16 or 24 byte copies, which may run up to SPAN_SLACK bytes past the end
+ * of a row. The SIMD renderer looks colors up in r[], g[] and b[] instead.
+ */
+#define SPAN_SIZE 24
+#define SPAN_SLACK SPAN_SIZE
+
+struct rgb_table {
+	unsigned char spans[16][SPAN_SIZE];
+	unsigned char r[16], g[16], b[16];
+	int simd;
+};
+
+static void make_rgb_table(const struct c64koala_palette *palette,
+                           struct rgb_table *t)
+{
+	int i, j;
+	for (i = 0; i < 16; ++i) {
+		for (j = 0; j < SPAN_SIZE; j += 3)
+			memcpy(t->spans[i] + j, &palette->rgb[i], 3);
+		t->r[i] = palette->rgb[i].r;
+		t->g[i] = palette->rgb[i].g;
+		t->b[i] = palette->rgb[i].b;
+	}
+	t->simd = 0;
+#ifdef HAVE_X86_SIMD
+	t->simd = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * The SIMD renderer looks up the red, green and blue of 16 pixels at once
+ * with pshufb and interleaves them into 48 bytes of RGB. It only pays off up
+ * to double width: beyond that, rows are written faster than pshufb can keep
+ * up, and whole span copies win.
+ */
+__attribute__((target("ssse3")))
+static unsigned char *store_rgb16(__m128i red, __m128i green, __m128i blue,
+                                  unsigned char *out)
+{
+	/* for each 16 bytes of RGB, where its bytes come from in each channel */
+	static const signed char interleave[3][3][16] = {
+		{ {  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1, -1,  5 },
+		  { -1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1, -1 },
+		  { -1, -1,  0, -1, -1,  1, -1, -1,  2, -1, -1,  3, -1, -1,  4, -1 } },
+		{ { -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1, 10, -1 },
+		  {  5, -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1, 10 },
+		  { -1,  5, -1, -1,  6, -1, -1,  7, -1, -1,  8, -1, -1,  9, -1, -1 } },
+		{ { -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1 },
+		  { -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1 },
+		  { 10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15 } }
+	};
+	const __m128i (*mask)[3] = (const __m128i (*)[3])interleave;
+	int i;
+	
+	for (i = 0; i < 3; ++i, out += 16)
+		_mm_storeu_si128((__m128i *)out, _mm_or_si128(
+		        _mm_or_si128(_mm_shuffle_epi8(red, _mm_loadu_si128(&mask[i][0])),
+		                     _mm_shuffle_epi8(green, _mm_loadu_si128(&mask[i][1]))),
+		        _mm_shuffle_epi8(blue, _mm_loadu_si128(&mask[i][2]))));
+	return out;
+}
+
+__attribute__((target("ssse3")))
+static unsigned char *render_rgb16(const struct rgb_table *t, __m128i pixels,
+                                   unsigned char *out)
+{
+	return store_rgb16(
+	        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)t->r), pixels),
+	        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)t->g), pixels),
+	        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)t->b), pixels),
+	        out);
+}
+
+/* render_row() for scale 1 or 2; a pixel is doubled by pairing up its index */
+__attribute__((target("ssse3")))
+static void render_row_ssse3(const struct rgb_table *t,
+                             const unsigned char *row, int scale,
+                             unsigned char *out)
+{
+	__m128i pixels;
+	int x;
+	
+	for (x = 0; x < C64KOALA_WIDTH; x += 16) {
+		pixels = _mm_loadu_si128((const __m128i *)(row + x));
+		if (scale == 1) {
+			out = render_rgb16(t, pixels, out);
+		} else {
+			out = render_rgb16(t, _mm_unpacklo_epi8(pixels, pixels), out);
+			out = render_rgb16(t, _mm_unpackhi_epi8(pixels, pixels), out);
+		}
+	}
+}
+#endif
+
+/* resolve one row of C64 color indices to RGB, each pixel scale times over */
+static void render_row(const struct rgb_table *t, const unsigned char *row,
+                       int scale, unsigned char *out)
+{
+	const unsigned char (*spans)[SPAN_SIZE] = t->spans;
+	size_t step = 3 * scale, n;
+	int x;
+	
+#ifdef HAVE_X86_SIMD
+	if (t->simd && scale <= 2) {
+		render_row_ssse3(t, row, scale, out);
+		return;
+	}
+#endif
+	if (step <= 8) {
+		for (x = 0; x < C64KOALA_WIDTH; ++x, out += step)
+			memcpy(out, spans[row[x]], 8);
+	} else if (step <= 16) {
+		for (x = 0; x < C64KOALA_WIDTH; ++x, out += step)
+			memcpy(out, spans[row[x]], 16);
+	} else if (step <= 24) {
+		for (x = 0; x < C64KOALA_WIDTH; ++x, out += step)
+			memcpy(out, spans[row[x]], 24);
+	} else {
+		for (x = 0; x < C64KOALA_WIDTH; ++x, out += step)
+			for (n = 0; n < step; n += SPAN_SIZE)
+				memcpy(out + n, spans[row[x]], SPAN_SIZE);
+	}
+}
+
+/*
+ * The CRT filter makes an image look the way a PAL TV shows it. Each pixel is
+ * split into luma, with the BT.601 weights of the default palette's YUV model,
+ * and the chroma that is left of R, G and B. PAL carries color at about a
+ * third of the rate of the C64's pixels, so chroma is blurred across each
+ * line, and a PAL decoder's delay line averages it with the line above. Luma
+ * stays sharp. Everything is in fixed point with 3 fraction bits, so a pixel
+ * among its own color comes out unchanged. Scaled up, the lower half of the
+ * rows of each line are darkened into scanlines.
+ */
+struct crt {
+	short luma[16], chroma[3][16];
+	/* the same as bytes for pshufb, low bytes then high bytes */
+	unsigned char bytes[4][2][16];
+	short above[3][C64KOALA_WIDTH]; /* the last line's blurred chroma */
+	int first, simd;
+};
+
+static void crt_start(struct crt *crt, const struct c64koala_palette *palette)
+{
+	const struct c64koala_rgb *rgb;
+	int i, k;
+	
+	for (i = 0; i < 16; ++i) {
+		rgb = &palette->rgb[i];
+		crt->luma[i] = (8 * (299*rgb->r + 587*rgb->g + 114*rgb->b) + 500) / 1000;
+		crt->chroma[0][i] = 8*rgb->r - crt->luma[i];
+		crt->chroma[1][i] = 8*rgb->g - crt->luma[i];
+		crt->chroma[2][i] = 8*rgb->b - crt->luma[i];
+		for (k = 0; k < 4; ++k) {
+			crt->bytes[k][0][i] = (k ? crt->chroma[k-1][i] : crt->luma[i]) & 0xff;
+			crt->bytes[k][1][i] = (k ? crt->chroma[k-1][i] : crt->luma[i]) >> 8 & 0xff;
+		}
+	}
+	crt->first = 1;
+	crt->simd = 0;
+#ifdef HAVE_X86_SIMD
+	crt->simd = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+/* filter a row of color indices into a row each of R, G and B */
+static void crt_filter(struct crt *crt, const unsigned char *row,
+                       unsigned char planes[3][C64KOALA_WIDTH])
+{
+	/* each pixel's chroma, with the pixels at the ends repeated */
+	short chroma[1 + C64KOALA_WIDTH + 1], *above;
+	int luma[C64KOALA_WIDTH];
+	int x, k, blur, v;
+	
+	for (x = 0; x < C64KOALA_WIDTH; ++x)
+		luma[x] = 8 * crt->luma[row[x]] + 32;
+	for (k = 0; k < 3; ++k) {
+		for (x = 0; x < C64KOALA_WIDTH; ++x)
+			chroma[1 + x] = crt->chroma[k][row[x]];
+		chroma[0] = chroma[1];
+		chroma[C64KOALA_WIDTH + 1] = chroma[C64KOALA_WIDTH];
+		above = crt->above[k];
+		if (crt->first) {
+			for (x = 0; x < C64KOALA_WIDTH; ++x)
+				above[x] = chroma[x] + 2 * chroma[x + 1] + chroma[x + 2];
+		}
+		for (x = 0; x < C64KOALA_WIDTH; ++x) {
+			blur = chroma[x] + 2 * chroma[x + 1] + chroma[x + 2];
+			v = (luma[x] + blur + above[x]) >> 6;
+			above[x] = blur;
+			planes[k][x] = v < 0 ? 0 : v > 255 ? 255 : v;
+		}
+	}
+	crt->first = 0;
+}
+
+#ifdef HAVE_X86_SIMD
+/* crt_filter() 16 pixels at a time, with the same results */
+__attribute__((target("ssse3")))
+static void crt_filter_ssse3(struct crt *crt, const unsigned char *row,
+                             unsigned char planes[3][C64KOALA_WIDTH])
+{
+	/* each pixel's chroma, with the pixels at the ends repeated */
+	short chroma[3][1 + C64KOALA_WIDTH + 1];
+	const __m128i (*bytes)[2] = (const __m128i (*)[2])crt->bytes;
+	__m128i pixels, lo, hi, luma[2], blur, above, v[2];
+	int x, k, h;
+	
+	for (x = 0; x < C64KOALA_WIDTH; x += 16) {
+		pixels = _mm_loadu_si128((const __m128i *)(row + x));
+		for (k = 0; k < 3; ++k) {
+			lo = _mm_shuffle_epi8(_mm_loadu_si128(&bytes[k+1][0]), pixels);
+			hi = _mm_shuffle_epi8(_mm_loadu_si128(&bytes[k+1][1]), pixels);
+			_mm_storeu_si128((__m128i *)&chroma[k][1 + x], _mm_unpacklo_epi8(lo, hi));
+			_mm_storeu_si128((__m128i *)&chroma[k][9 + x], _mm_unpackhi_epi8(lo, hi));
+		}
+	}
+	for (k = 0; k < 3; ++k) {
+		chroma[k][0] = chroma[k][1];
+		chroma[k][C64KOALA_WIDTH + 1] = chroma[k][C64KOALA_WIDTH];
+	}
+	
+	for (x = 0; x < C64KOALA_WIDTH; x += 16) {
+		pixels = _mm_loadu_si128((const __m128i *)(row + x));
+		lo = _mm_shuffle_epi8(_mm_loadu_si128(&bytes[0][0]), pixels);
+		hi = _mm_shuffle_epi8(_mm_loadu_si128(&bytes[0][1]), pixels);
+		luma[0] = _mm_add_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(lo, hi), 3),
+		                        _mm_set1_epi16(32));
+		luma[1] = _mm_add_epi16(_mm_slli_epi16(_mm_unpackhi_epi8(lo, hi), 3),
+		                        _mm_set1_epi16(32));
+		for (k = 0; k < 3; ++k) {
+			for (h = 0; h < 2; ++h) {
+				blur = _mm_add_epi16(
+				        _mm_add_epi16(_mm_loadu_si128((const __m128i *)&chroma[k][x + 8*h]),
+				                      _mm_loadu_si128((const __m128i *)&chroma[k][x + 8*h + 2])),
+				        _mm_slli_epi16(_mm_loadu_si128((const __m128i *)&chroma[k][x + 8*h + 1]), 1));
+				above = crt->first ? blur :
+				        _mm_loadu_si128((const __m128i *)&crt->above[k][x + 8*h]);
+				_mm_storeu_si128((__m128i *)&crt->above[k][x + 8*h], blur);
+				v[h] = _mm_srai_epi16(_mm_add_epi16(luma[h],
+				                                    _mm_add_epi16(blur, above)), 6);
+			}
+			_mm_storeu_si128((__m128i *)(planes[k] + x),
+			                 _mm_packus_epi16(v[0], v[1]));
+		}
+	}
+	crt->first = 0;
+}
+
+/*
+ * Interleave rows of R, G and B into RGB, each pixel scale times over, where
+ * scale is 1, 2, 4 or 8. A pixel is doubled by pairing it up with itself.
+ */
+__attribute__((target("ssse3")))
+static void crt_interleave_ssse3(unsigned char planes[3][C64KOALA_WIDTH],
+                                 int scale, unsigned char *out)
+{
+	__m128i w[8][3];
+	int x, n, i, k;
+	
+	for (x = 0; x < C64KOALA_WIDTH; x += 16) {
+		for (k = 0; k < 3; ++k)
+			w[0][k] = _mm_loadu_si128((const __m128i *)(planes[k] + x));
+		for (n = 1; n < scale; n *= 2) {
+			for (i = n - 1; i >= 0; --i) {
+				for (k = 0; k < 3; ++k) {
+					w[2*i+1][k] = _mm_unpackhi_epi8(w[i][k], w[i][k]);
+					w[2*i][k] = _mm_unpacklo_epi8(w[i][k], w[i][k]);
+				}
+			}
+		}
+		for (i = 0; i < scale; ++i)
+			out = store_rgb16(w[i][0], w[i][1], w[i][2], out);
+	}
+}
+#endif
+
+/* render_row() through the CRT filter */
+static void crt_row(struct crt *crt, const unsigned char *row, int scale,
+                    unsigned char *out)
+{
+	unsigned char planes[3][C64KOALA_WIDTH];
+	int x, i;
+	
+#ifdef HAVE_X86_SIMD
+	if (crt->simd) {
+		crt_filter_ssse3(crt, row, planes);
+		if (scale <= 8 && !(scale & (scale - 1))) {
+			crt_interleave_ssse3(planes, scale, out);
+			return;
+		}
+	}
+#endif
+	if (!crt->simd)
+		crt_filter(crt, row, planes);
+	for (x = 0; x < C64KOALA_WIDTH; ++x) {
+		for (i = 0; i < scale; ++i) {
+			*out++ = planes[0][x];
+			*out++ = planes[1][x];
+			*out++ = planes[2][x];
+		}
+	}
+}
+
+/* whether the CRT filter darkens row i of the scale rows of each line */
+static int crt_scanline(const struct c64koala_output *output, int i)
+{
+	return output->crt && 2*i >= output->scale;
+}
+
+/* copy a row of len bytes at half brightness; len is a multiple of 8 */
+static void darken_row(unsigned char *out, const unsigned char *row, size_t len)
+{
+	unsigned long long word;
+	size_t i;
+	for (i = 0; i < len; i += sizeof(word)) {
+		memcpy(&word, row + i, sizeof(word));
+		word = word >> 1 & 0x7f7f7f7f7f7f7f7fULL;
+		memcpy(out + i, &word, sizeof(word));
+	}
+}
+
+/* write n pixels of one color; n is a multiple of 8 */
+static void fill_row(const struct rgb_table *t, int color, int n,
+                     unsigned char *out)
+{
+	int x;
+	for (x = 0; x < n; x += 8, out += SPAN_SIZE)
+		memcpy(out, t->spans[color], SPAN_SIZE);
+}
+
+/*
+ * Write one row of RGB output: a row of color indices, or with row NULL,
+ * one of the border above or below the picture. In a frame, the picture is
+ * written in place between the left and the right border, which covers up
+ * whatever render_row() wrote past the picture's end.
+ */
+static void pnm_row(const struct c64koala_output *output,
+                    const struct rgb_table *t, struct crt *crt,
+                    const unsigned char *row, unsigned char *out)
+{
+	int left = 0;
+	
+	if (framed(output)) {
+		left = BORDER_LEFT * output->scale;
+		if (!row) {
+			fill_row(t, output->border, output_width(output), out);
+			return;
+		}
+		fill_row(t, output->border, left, out);
+	}
+	if (output->crt)
+		crt_row(crt, row, xscale(output),
+		        out + sizeof(struct c64koala_rgb) * left);
+	else
+		render_row(t, row, xscale(output),
+		           out + sizeof(struct c64koala_rgb) * left);
+	if (left)
+		fill_row(t, output->border, left, out + sizeof(struct c64koala_rgb) *
+		         (output_width(output) - left));
+}
+
+/* the header of a PPM or, for C64KOALA_FORMAT_PAM, a PAM */
+#define PNM_HEADER_SIZE 80
+
+/* the longest row of RGB, that of a frame at the largest scale */
+#define PNM_MAX_ROW \
+	(sizeof(struct c64koala_rgb) * C64KOALA_FRAME_WIDTH * C64KOALA_MAX_SCALE)
+
+static size_t pnm_header(int format, char *buf, int width, int height)
+{
+	if (format == C64KOALA_FORMAT_PAM)
+		return sprintf(buf, "P7\n"
+		                    "WIDTH %d\n"
+		                    "HEIGHT %d\n"
+		                    "DEPTH 3\n"
+		                    "MAXVAL 255\n"
+		                    "TUPLTYPE RGB\n"
+		                    "ENDHDR\n", width, height);
+	return ppm_header(buf, width, height);
+}
+
+static size_t ppm_size(const struct c64koala_output *output)
+{
+	return PNM_HEADER_SIZE + sizeof(struct c64koala_rgb) *
+	       output_width(output) * output_height(output) + SPAN_SLACK;
+}
+
+static size_t ppm_write(const struct c64koala_output *output,
+                        const unsigned char image[][C64KOALA_WIDTH],
+                        unsigned char *buf)
+{
+	struct rgb_table table;
+	struct crt crt;
+	size_t len, rowsize, linesize;
+	unsigned char *row;
+	int top = framed(output) ? BORDER_TOP : 0;
+	int bottom = framed(output) ? BORDER_BOTTOM : 0;
+	int y, i;
+	
+	make_rgb_table(output->palette, &table);
+	if (output->crt)
+		crt_start(&crt, output->palette);
+	rowsize = sizeof(struct c64koala_rgb) * output_width(output);
+	linesize = rowsize * output->scale;
+	len = pnm_header(output->format, (char *)buf, output_width(output),
+	                 output_height(output));
+	for (y = -top; y < C64KOALA_HEIGHT + bottom; ++y) {
+		row = buf + len;
+		if ((y < 0 && y > -top) || y > C64KOALA_HEIGHT) {
+			/* the same border as the line before */
+			memcpy(row, row - linesize, linesize);
+			len += linesize;
+			continue;
+		}
+		/* render each row once and copy it for the rest of its height */
+		pnm_row(output, &table, &crt,
+		        y >= 0 && y < C64KOALA_HEIGHT ? image[y] : NULL, row);
+		len += rowsize;
+		for (i = 1; i < output->scale; ++i, len += rowsize) {
+			if (crt_scanline(output, i))
+				darken_row(buf + len, row, rowsize);
+			else
+				memcpy(buf + len, row, rowsize);
+		}
+	}
+	return len;
+}
+
+static int ppm_stream(const struct c64koala_ctx *ctx,
+                      const struct c64koala_output *output,
+                      const struct c64koala *koala, FILE *outfile)
+{
+	char header[PNM_HEADER_SIZE];
+	struct rgb_table table;
+	struct crt crt;
+	unsigned char rows[8][C64KOALA_WIDTH];
+	unsigned char row[PNM_MAX_ROW + SPAN_SLACK];
+	unsigned char dark[PNM_MAX_ROW];
+	size_t rowsize;
+	int top = framed(output) ? BORDER_TOP : 0;
+	int bottom = framed(output) ? BORDER_BOTTOM : 0;
+	int y, i;
+	
+	make_rgb_table(output->palette, &table);
+	if (output->crt)
+		crt_start(&crt, output->palette);
+	rowsize = sizeof(struct c64koala_rgb) * output_width(output);
+	if (fwrite(header, pnm_header(output->format, header, output_width(output),
+	                              output_height(output)),
+	           1, outfile) != 1)
+		return -1;
+	for (y = -top; y < C64KOALA_HEIGHT + bottom; ++y) {
+		if (y >= 0 && y < C64KOALA_HEIGHT) {
+			if (y % 8 == 0)
+				c64koala_decode_card_row(ctx, koala, y / 8, rows);
+			pnm_row(output, &table, &crt, rows[y % 8], row);
+		} else if (y == -top || y == C64KOALA_HEIGHT) {
+			/* the rest of the border above or below is the same */
+			pnm_row(output, &table, &crt, NULL, row);
+		}
+		if (output->crt)
+			darken_row(dark, row, rowsize);
+		for (i = 0; i < output->scale; ++i)
+			if (fwrite(crt_scanline(output, i) ? dark : row,
+			           rowsize, 1, outfile) != 1)
+				return -1;
+	}
+	return 0;
+}
+
+/* pack a row of color indices, each scale times over, two pixels per byte */
+static void pack_row(const unsigned char *row, int scale, unsigned char *out)
+{
+	int x, i, n = 0;
+	if (scale == 1) {
+		for (x = 0; x < C64KOALA_WIDTH; x += 2)
+			out[x/2] = row[x] << 4 | row[x+1];
+		return;
+	}
+	for (x = 0; x < C64KOALA_WIDTH; ++x)
+		for (i = 0; i < scale; ++i, ++n)
+			if (n & 1)
+				out[n/2] |= row[x];
+			else
+				out[n/2] = row[x] << 4;
+}
+
+/* the PNG CRC-32, four bits at a time */
+static unsigned long png_crc(const unsigned char *p, size_t len)
+{
+	static const unsigned long table[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+		0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+		0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+	};
+	unsigned long crc = 0xffffffff;
+	while (len--) {
+		crc ^= *p++;
+		crc = (crc >> 4) ^ table[crc & 15];
+		crc = (crc >> 4) ^ table[crc & 15];
+	}
+	return crc ^ 0xffffffff;
+}
+
+static void put_be32(unsigned char *p, unsigned long value)
+{
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+/* finish a PNG chunk at p whose len bytes of data are already at p + 8 */
+static size_t png_chunk(unsigned char *p, const char *type, size_t len)
+{
+	put_be32(p, len);
+	memcpy(p + 4, type, 4);
+	put_be32(p + 8 + len, png_crc(p + 4, 4 + len));
+	return 12 + len;
+}
+
+#define ALIGN16(n) (((n) + 15) & ~(size_t)15)
+
+/* the scanlines: a filter type byte and then two pixels per byte */
+static size_t png_raw_size(const struct c64koala_output *output)
+{
+	return (size_t)C64KOALA_HEIGHT * output->scale *
+	       (1 + C64KOALA_WIDTH / 2 * xscale(output));
+}
+
+/*
+ * A PNG is written at the start of the buffer. The scanlines are put together
+ * after the most room it can take, followed by the compressor's scratch space.
+ */
+static size_t png_raw_offset(const struct c64koala_output *output)
+{
+	return ALIGN16(8 + (12 + 13) + (12 + 3*16) +
+	               (12 + C64KOALA_ZLIB_BOUND(png_raw_size(output))) + 12);
+}
+
+static size_t png_size(const struct c64koala_output *output)
+{
+	return png_raw_offset(output) +
+	       ALIGN16(png_raw_size(output)) +
+	       c64koala_zlib_scratch_size();
+}
+
+static size_t png_write(const struct c64koala_output *output,
+                        const unsigned char image[][C64KOALA_WIDTH],
+                        unsigned char *buf)
+{
+	static const unsigned char signature[8] = {
+		137, 'P', 'N', 'G', '\r', '\n', 26, '\n'
+	};
+	unsigned char *raw, *row, *p;
+	size_t rawlen = 0, rowsize, len;
+	int y, i;
+	
+	/*
+	 * The C64 color indices are the PNG's palette indices. Rows are left
+	 * unfiltered, which suits a palette image best, and each is packed once
+	 * and copied for the rest of its height.
+	 */
+	raw = buf + png_raw_offset(output);
+	rowsize = 1 + C64KOALA_WIDTH / 2 * xscale(output);
+	for (y = 0; y < C64KOALA_HEIGHT; ++y) {
+		row = raw + rawlen;
+		row[0] = 0;
+		pack_row(image[y], xscale(output), row + 1);
+		rawlen += rowsize;
+		for (i = 1; i < output->scale; ++i, rawlen += rowsize)
+			memcpy(raw + rawlen, row, rowsize);
+	}
+	
+	memcpy(buf, signature, 8);
+	len = 8;
+	p = buf + len + 8;
+	put_be32(p, C64KOALA_WIDTH * xscale(output));
+	put_be32(p + 4, C64KOALA_HEIGHT * output->scale);
+	p[8] = 4; /* bit depth */
+	p[9] = 3; /* indexed color */
+	p[10] = p[11] = p[12] = 0; /* deflate, no filter choice, no interlace */
+	len += png_chunk(buf + len, "IHDR", 13);
+	p = buf + len + 8;
+	for (i = 0; i < 16; ++i) {
+		p[3*i] = output->palette->rgb[i].r;
+		p[3*i+1] = output->palette->rgb[i].g;
+		p[3*i+2] = output->palette->rgb[i].b;
+	}
+	len += png_chunk(buf + len, "PLTE", 3*16);
+	len += png_chunk(buf + len, "IDAT",
+	                 c64koala_zlib_compress(buf + len + 8, raw, rawlen,
+	                                        output->level == C64KOALA_LEVEL_BEST,
+	                                        raw + ALIGN16(rawlen)));
+	len += png_chunk(buf + len, "IEND", 0);
+	return len;
+}
+
+/* the raw format is only the color indices, two pixels per byte */
+static size_t raw_size(const struct c64koala_output *output)
+{
+	return (size_t)C64KOALA_WIDTH / 2 * xscale(output) *
+	       C64KOALA_HEIGHT * output->scale;
+}
+
+static size_t raw_write(const struct c64koala_output *output,
+                        const unsigned char image[][C64KOALA_WIDTH],
+                        unsigned char *buf)
+{
+	size_t len = 0, rowsize = C64KOALA_WIDTH / 2 * xscale(output);
+	int y, i;
+	for (y = 0; y < C64KOALA_HEIGHT; ++y) {
+		pack_row(image[y], xscale(output), buf + len);
+		len += rowsize;
+		for (i = 1; i < output->scale; ++i, len += rowsize)
+			memcpy(buf + len, buf + len - rowsize, rowsize);
+	}
+	return len;
+}
+
+static int raw_stream(const struct c64koala_ctx *ctx,
+                      const struct c64koala_output *output,
+                      const struct c64koala *koala, FILE *outfile)
+{
+	unsigned char rows[8][C64KOALA_WIDTH];
+	unsigned char row[C64KOALA_WIDTH / 2 * MAX_XSCALE];
+	size_t rowsize = C64KOALA_WIDTH / 2 * xscale(output);
+	int cardy, y, i;
+	
+	for (cardy = 0; cardy < 25; ++cardy) {
+		c64koala_decode_card_row(ctx, koala, cardy, rows);
+		for (y = 0; y < 8; ++y) {
+			pack_row(rows[y], xscale(output), row);
+			for (i = 0; i < output->scale; ++i)
+				if (fwrite(row, rowsize, 1, outfile) != 1)
+					return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * QOI, the Quite OK Image format, as its 1.0 specification has it. Only the
+ * 16 palette colors can occur, so the encoder works on color indices: the
+ * bytes that take the image from any color to any other are worked out up
+ * front, and the main loop only compares indices.
+ */
+struct qoi {
+	unsigned char canon[16]; /* the first color index with the same RGB */
+	unsigned char hash[16];
+	/* from color to color, and from the starting black, 16 */
+	unsigned char op[17][16][4], oplen[17][16];
+	unsigned char index[64]; /* the color in each slot, 16 for none */
+	int prev, run;
+};
+
+/* the most bytes a QOI row can take: a run and a whole pixel per change */
+#define QOI_ROW_SIZE(scale) (5 * C64KOALA_WIDTH + C64KOALA_WIDTH * (scale) / 62 + 1)
+
+/* the bytes that take a QOI image from color a to b, which must differ */
+static int qoi_op(const struct c64koala_rgb *a, const struct c64koala_rgb *b,
+                  unsigned char *op)
+{
+	int dr = (signed char)(b->r - a->r);
+	int dg = (signed char)(b->g - a->g);
+	int db = (signed char)(b->b - a->b);
+	
+	if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+		op[0] = 0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+		return 1;
+	}
+	if (dg >= -32 && dg <= 31 && dr - dg >= -8 && dr - dg <= 7 &&
+	    db - dg >= -8 && db - dg <= 7) {
+		op[0] = 0x80 | (dg + 32);
+		op[1] = (dr - dg + 8) << 4 | (db - dg + 8);
+		return 2;
+	}
+	op[0] = 0xfe;
+	op[1] = b->r;
+	op[2] = b->g;
+	op[3] = b->b;
+	return 4;
+}
+
+static void qoi_start(struct qoi *q, const struct c64koala_output *output,
+                      unsigned char *out)
+{
+	static const struct c64koala_rgb black = { 0, 0, 0 };
+	const struct c64koala_palette *palette = output->palette;
+	const struct c64koala_rgb *from, *c;
+	int i, j;
+	
+	q->prev = 16;
+	for (i = 0; i < 16; ++i) {
+		c = &palette->rgb[i];
+		for (j = 0; j < i && memcmp(c, &palette->rgb[j], sizeof(*c)); ++j)
+			;
+		q->canon[i] = j;
+		q->hash[i] = (c->r * 3 + c->g * 5 + c->b * 7 + 255 * 11) % 64;
+		if (q->prev == 16 && !memcmp(c, &black, sizeof(*c)))
+			q->prev = j;
+	}
+	for (i = 0; i < 17; ++i) {
+		from = i < 16 ? &palette->rgb[i] : &black;
+		for (j = 0; j < 16; ++j)
+			if (q->canon[j] == j && memcmp(from, &palette->rgb[j], sizeof(*from)))
+				q->oplen[i][j] = qoi_op(from, &palette->rgb[j], q->op[i][j]);
+	}
+	memset(q->index, 16, sizeof(q->index));
+	q->run = 0;
+	
+	memcpy(out, "qoif", 4);
+	put_be32(out + 4, C64KOALA_WIDTH * xscale(output));
+	put_be32(out + 8, C64KOALA_HEIGHT * output->scale);
+	out[12] = 3; /* RGB */
+	out[13] = 0; /* sRGB */
+}
+
+#define QOI_HEADER_SIZE 14
+#define QOI_END_SIZE 8
+
+/* add n pixels like the last one. Returns where the output now ends. */
+static unsigned char *qoi_run(struct qoi *q, int n, unsigned char *out)
+{
+	for (q->run += n; q->run >= 62; q->run -= 62)
+		*out++ = 0xc0 | 61;
+	return out;
+}
+
+/*
+ * Encode a row of color indices, each scale times over. All four bytes of an
+ * op are copied whatever its length, which QOI_ROW_SIZE() leaves room for.
+ */
+static unsigned char *qoi_row(struct qoi *q, const unsigned char *row,
+                              int scale, unsigned char *out)
+{
+	int x, n, c, h;
+	
+	for (x = 0; x < C64KOALA_WIDTH; ++x) {
+		c = q->canon[row[x]];
+		if (c == q->prev) {
+			for (n = 1; x + n < C64KOALA_WIDTH && row[x+n] == row[x]; ++n)
+				;
+			out = qoi_run(q, n * scale, out);
+			x += n - 1;
+			continue;
+		}
+		if (q->run) {
+			*out++ = 0xc0 | (q->run - 1);
+			q->run = 0;
+		}
+		h = q->hash[c];
+		if (q->index[h] == c) {
+			*out++ = h;
+		} else {
+			q->index[h] = c;
+			memcpy(out, q->op[q->prev][c], 4);
+			out += q->oplen[q->prev][c];
+		}
+		q->prev = c;
+		if (scale > 1)
+			out = qoi_run(q, scale - 1, out);
+	}
+	return out;
+}
+
+/* end the last run and the image */
+static unsigned char *qoi_end(struct qoi *q, unsigned char *out)
+{
+	static const unsigned char end[QOI_END_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+	if (q->run)
+		*out++ = 0xc0 | (q->run - 1);
+	q->run = 0;
+	memcpy(out, end, QOI_END_SIZE);
+	return out + QOI_END_SIZE;
+}
+
+static size_t qoi_size(const struct c64koala_output *output)
+{
+	return QOI_HEADER_SIZE + (size_t)C64KOALA_HEIGHT * output->scale *
+	       QOI_ROW_SIZE(xscale(output)) + QOI_END_SIZE;
+}
+
+static size_t qoi_write(const struct c64koala_output *output,
+                        const unsigned char image[][C64KOALA_WIDTH],
+                        unsigned char *buf)
+{
+	struct qoi q;
+	unsigned char *out = buf + QOI_HEADER_SIZE;
+	int y, i;
+	
+	qoi_start(&q, output, buf);
+	for (y = 0; y < C64KOALA_HEIGHT; ++y)
+		for (i = 0; i < output->scale; ++i)
+			out = qoi_row(&q, image[y], xscale(output), out);
+	return qoi_end(&q, out) - buf;
+}
+
+static int qoi_stream(const struct c64koala_ctx *ctx,
+                      const struct c64koala_output *output,
+                      const struct c64koala *koala, FILE *outfile)
+{
+	struct qoi q;
+	unsigned char rows[8][C64KOALA_WIDTH];
+	unsigned char buf[QOI_ROW_SIZE(MAX_XSCALE) + QOI_END_SIZE];
+	unsigned char *out;
+	int cardy, y, i;
+	
+	qoi_start(&q, output, buf);
+	if (fwrite(buf, QOI_HEADER_SIZE, 1, outfile) != 1)
+		return -1;
+	for (cardy = 0; cardy < 25; ++cardy) {
+		c64koala_decode_card_row(ctx, koala, cardy, rows);
+		for (y = 0; y < 8; ++y) {
+			for (i = 0; i < output->scale; ++i) {
+				out = qoi_row(&q, rows[y], xscale(output), buf);
+				if (out > buf && fwrite(buf, out - buf, 1, outfile) != 1)
+					return -1;
+			}
+		}
+	}
+	out = qoi_end(&q, buf);
+	return fwrite(buf, out - buf, 1, outfile) != 1;
+}
+
+static void put_le16(unsigned char *p, unsigned value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+}
+
+static void put_le32(unsigned char *p, unsigned long value)
+{
+	put_le16(p, value);
+	put_le16(p + 2, value >> 16);
+}
+
+/*
+ * BMP, 4 bits per pixel with the palette as the color table. Rows are
+ * stored bottom up and padded to four bytes, which 160 pixels already are.
+ */
+#define BMP_HEADER_SIZE (14 + 40 + 4*16)
+
+static size_t bmp_size(const struct c64koala_output *output)
+{
+	return BMP_HEADER_SIZE + raw_size(output);
+}
+
+static void bmp_header(const struct c64koala_output *output, unsigned char *p)
+{
+	const struct c64koala_rgb *c;
+	int i;
+	
+	memset(p, 0, BMP_HEADER_SIZE);
+	/* the file header */
+	p[0] = 'B';
+	p[1] = 'M';
+	put_le32(p + 2, bmp_size(output));
+	put_le32(p + 10, BMP_HEADER_SIZE);
+	/* the info header */
+	p += 14;
+	put_le32(p, 40);
+	put_le32(p + 4, C64KOALA_WIDTH * xscale(output));
+	put_le32(p + 8, C64KOALA_HEIGHT * output->scale);
+	put_le16(p + 12, 1); /* planes */
+	put_le16(p + 14, 4); /* bits per pixel */
+	put_le32(p + 20, raw_size(output));
+	put_le32(p + 24, 2835); /* 72 dpi */
+	put_le32(p + 28, 2835);
+	put_le32(p + 32, 16); /* colors */
+	/* the color table */
+	p += 40;
+	for (i = 0; i < 16; ++i) {
+		c = &output->palette->rgb[i];
+		p[4*i] = c->b;
+		p[4*i+1] = c->g;
+		p[4*i+2] = c->r;
+	}
+}
+
+static size_t bmp_write(const struct c64koala_output *output,
+                        const unsigned char image[][C64KOALA_WIDTH],
+                        unsigned char *buf)
+{
+	size_t len = BMP_HEADER_SIZE, rowsize = C64KOALA_WIDTH / 2 * xscale(output);
+	int y, i;
+	
+	bmp_header(output, buf);
+	for (y = C64KOALA_HEIGHT - 1; y >= 0; --y) {
+		pack_row(image[y], xscale(output), buf + len);
+		len += rowsize;
+		for (i = 1; i < output->scale; ++i, len += rowsize)
+			memcpy(buf + len, buf + len - rowsize, rowsize);
+	}
+	return len;
+}
+
+/* card rows decode in any order, so a BMP streams from the bottom up */
+static int bmp_stream(const struct c64koala_ctx *ctx,
+                      const struct c64koala_output *output,
+                      const struct c64koala *koala, FILE *outfile)
+{
+	unsigned char header[BMP_HEADER_SIZE];
+	unsigned char rows[8][C64KOALA_WIDTH];
+	unsigned char row[C64KOALA_WIDTH / 2 * MAX_XSCALE];
+	size_t rowsize = C64KOALA_WIDTH / 2 * xscale(output);
+	int cardy, y, i;
+	
+	bmp_header(output, header);
+	if (fwrite(header, BMP_HEADER_SIZE, 1, outfile) != 1)
+		return -1;
+	for (cardy = 24; cardy >= 0; --cardy) {
+		c64koala_decode_card_row(ctx, koala, cardy, rows);
+		for (y = 7; y >= 0; --y) {
+			pack_row(rows[y], xscale(output), row);
+			for (i = 0; i < output->scale; ++i)
+				if (fwrite(row, rowsize, 1, outfile) != 1)
+					return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * GIF, with the palette as the global color table and the color indices
+ * LZW compressed as they are. With only 16 colors, the string table is a
+ * plain array of the code for each code followed by each color. Before the
+ * first pixel the string is GIF_END, which nothing follows.
+ */
+#define GIF_CLEAR 16
+#define GIF_END 17
+#define GIF_MAX_CODES 4096
+
+struct gif {
+	unsigned short (*next)[16]; /* 0 where there is no such string yet */
+	unsigned char *out, *block; /* block is the sub-block's length byte */
+	uint32_t bits;
+	int nbits, code, size, free;
+};
+
+static void gif_byte(struct gif *g, unsigned char byte)
+{
+	if (g->out - g->block == 256) {
+		*g->block = 255;
+		g->block = g->out++;
+	}
+	*g->out++ = byte;
+}
+
+static void gif_code(struct gif *g, int code)
+{
+	g->bits |= (uint32_t)code << g->nbits;
+	for (g->nbits += g->size; g->nbits >= 8; g->nbits -= 8) {
+		gif_byte(g, g->bits);
+		g->bits >>= 8;
+	}
+}
+
+/* start the string table over */
+static void gif_clear(struct gif *g)
+{
+	gif_code(g, GIF_CLEAR);
+	memset(g->next, 0, (GIF_END + 1) * sizeof(*g->next));
+	g->size = 5;
+	g->free = GIF_END + 1;
+}
+
+/* write out the string so far, which color does not continue */
+static void gif_add(struct gif *g, int color)
+{
+	if (g->code != GIF_END) {
+		gif_code(g, g->code);
+		g->next[g->code][color] = g->free;
+		memset(g->next[g->free], 0, sizeof(*g->next));
+		/* the decoder adds each code a step later, so widen a step later */
+		if (++g->free > 1 << g->size && g->size < 12)
+			++g->size;
+		if (g->free == GIF_MAX_CODES)
+			gif_clear(g);
+	}
+	g->code = color;
+}
+
+/* add a row of color indices, each scale times over */
+static void gif_row(struct gif *g, const unsigned char *row, int scale)
+{
+	unsigned short (*next)[16] = g->next;
+	int code = g->code, x, i;
+	
+	for (x = 0; x < C64KOALA_WIDTH; ++x) {
+		for (i = 0; i < scale; ++i) {
+			if (next[code][row[x]]) {
+				code = next[code][row[x]];
+				continue;
+			}
+			g->code = code;
+			gif_add(g, row[x]);
+			code = row[x];
+		}
+	}
+	g->code = code;
+}
+
+/* everything but the LZW data and the sub-blocks it is split into */
+#define GIF_HEADER_SIZE (6 + 7 + 3*16 + 10 + 1)
+#define GIF_TRAILER_SIZE (1 + 1)
+
+/* codes are at most 12 bits and stand for a pixel at least */
+static size_t gif_data_size(const struct c64koala_output *output)
+{
+	size_t pixels = (size_t)C64KOALA_WIDTH * xscale(output) *
+	                C64KOALA_HEIGHT * output->scale;
+	size_t len = pixels * 3 / 2 + pixels / 1024 + 16;
+	return len + len / 255 + 1;
+}
+
+/* the string table goes after the most room the GIF can take */
+static size_t gif_table_offset(const struct c64koala_output *output)
+{
+	return ALIGN16(GIF_HEADER_SIZE + gif_data_size(output) + GIF_TRAILER_SIZE);
+}
+
+static size_t gif_size(const struct c64koala_output *output)
+{
+	return gif_table_offset(output) +
+	       GIF_MAX_CODES * sizeof(unsigned short[16]);
+}
+
+static size_t gif_write(const struct c64koala_output *output,
+                        const unsigned char image[][C64KOALA_WIDTH],
+                        unsigned char *buf)
+{
+	const struct c64koala_rgb *c;
+	struct gif g;
+	unsigned char *p = buf;
+	int width = C64KOALA_WIDTH * xscale(output);
+	int height = C64KOALA_HEIGHT * output->scale;
+	int y, i;
+	
+	memcpy(p, "GIF89a", 6);
+	put_le16(p + 6, width);
+	put_le16(p + 8, height);
+	p[10] = 0xf3; /* a global color table of 16, from 8 bits per primary */
+	p[11] = 0; /* background */
+	p[12] = 0; /* square pixels */
+	p += 13;
+	for (i = 0; i < 16; ++i) {
+		c = &output->palette->rgb[i];
+		*p++ = c->r;
+		*p++ = c->g;
+		*p++ = c->b;
+	}
+	*p++ = 0x2c;
+	put_le16(p, 0);
+	put_le16(p + 2, 0);
+	put_le16(p + 4, width);
+	put_le16(p + 6, height);
+	p[8] = 0; /* no local color table, not interlaced */
+	p[9] = 4; /* the LZW minimum code size */
+	p += 10;
+	
+	g.next = (unsigned short (*)[16])(buf + gif_table_offset(output));
+	g.block = p;
+	g.out = p + 1;
+	g.bits = 0;
+	g.nbits = 0;
+	g.code = GIF_END;
+	g.size = 5;
+	gif_clear(&g);
+	for (y = 0; y < C64KOALA_HEIGHT; ++y)
+		for (i = 0; i < output->scale; ++i)
+			gif_row(&g, image[y], xscale(output));
+	gif_code(&g, g.code);
+	gif_code(&g, GIF_END);
+	if (g.nbits)
+		gif_byte(&g, g.bits);
+	/* an empty last sub-block is the terminator */
+	*g.block = g.out - g.block - 1;
+	if (*g.block)
+		*g.out++ = 0;
+	*g.out++ = 0x3b;
+	return g.out - buf;
+}
+
+/*
+ * A thumbnail pixel covers a whole card, or a quarter of one, and every pixel
+ * of a card is one of its four colors. So its average color only takes
+ * counting how many crumbs of the bitmap select each of the card's colors.
+ */
+/* how many thumbnail pixels each card becomes, across and down */
+static int thumb_per_card(const struct c64koala_output *output)
+{
+	switch (output->thumb) {
+	case C64KOALA_THUMB_40X25:
+		return 1;
+	case C64KOALA_THUMB_80X50:
+		return 2;
+	default: /* not a thumbnail */
+		return 0;
+	}
+}
+
+static int thumb_width(const struct c64koala_output *output)
+{
+	return 40 * thumb_per_card(output);
+}
+
+static int thumb_height(const struct c64koala_output *output)
+{
+	return 25 * thumb_per_card(output);
+}
+
+static size_t thumb_size(const struct c64koala_output *output)
+{
+	return PNM_HEADER_SIZE + sizeof(struct c64koala_rgb) *
+	       thumb_width(output) * thumb_height(output);
+}
+
+/* a card's bitmap as one word, its first byte lowest */
+static unsigned long long card_bits(const unsigned char bits[8])
+{
+	unsigned long long word;
+	memcpy(&word, bits, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	word = __builtin_bswap64(word);
+#endif
+	return word;
+}
+
+/*
+ * Given a card's bitmap with only the low bit of some crumbs set, count them
+ * in each quarter of the card: a nibble each, top left, top right, bottom
+ * left, bottom right, lowest first.
+ */
+static unsigned quarter_counts(unsigned long long plane)
+{
+	const unsigned long long crumbs = 0x0505050505050505ULL;
+	const unsigned long long pairs = 0x0303030303030303ULL;
+	unsigned long long left = plane >> 4 & crumbs, right = plane & crumbs;
+	unsigned long long sums;
+	
+	/* count each row of a quarter into a nibble, then add up 4 rows */
+	sums = ((left + (left >> 2)) & pairs) |
+	       ((right + (right >> 2)) & pairs) << 4;
+	sums *= 0x01010101;
+	return (sums >> 24 & 0xff) | (sums >> 56) << 8;
+}
+
+/* each color's RGB in 16-bit lanes, so that sums of colors add up at once */
+static void thumb_lanes(const struct c64koala_palette *palette,
+                        unsigned long long lanes[16])
+{
+	int i;
+	for (i = 0; i < 16; ++i)
+		lanes[i] = palette->rgb[i].r | (unsigned long long)palette->rgb[i].g << 16 |
+		           (unsigned long long)palette->rgb[i].b << 32;
+}
+
+/* average 1 << shift pixels, counts[i] of them in color pal[i] */
+static void thumb_pixel(const unsigned long long lanes[16],
+                        const unsigned char pal[4], const unsigned counts[4],
+                        int shift, unsigned char *out)
+{
+	unsigned long long sum = 0x000100010001ULL << shift >> 1;
+	int i;
+	
+	for (i = 0; i < 4; ++i)
+		sum += counts[i] * lanes[pal[i]];
+	out[0] = sum >> shift;
+	out[1] = sum >> (16 + shift);
+	out[2] = sum >> (32 + shift);
+}
+
+/* write the thumbnail pixels of card row cardy, whose first row is row */
+static void thumb_row(const unsigned long long lanes[16], int thumb,
+                      const struct c64koala *koala, int cardy,
+                      unsigned char *row, size_t rowsize)
+{
+	const unsigned long long low = 0x5555555555555555ULL;
+	unsigned long long bits, hi, lo;
+	unsigned char pal[4], *out;
+	unsigned quarters[4], counts[4];
+	int cardx, q, i;
+	
+	pal[0] = koala->bg & 0x0f;
+	for (cardx = 0; cardx < 40; ++cardx) {
+		pal[1] = (koala->video[cardy][cardx]>>4) & 0x0f;
+		pal[2] = (koala->video[cardy][cardx]) & 0x0f;
+		pal[3] = (koala->color[cardy][cardx]) & 0x0f;
+		
+		/* crumbs 3 have both bits set, 2 the high, 1 the low */
+		bits = card_bits(koala->bitmap[cardy][cardx]);
+		hi = bits >> 1 & low;
+		lo = bits & low;
+		quarters[3] = quarter_counts(hi & lo);
+		quarters[2] = quarter_counts(hi) - quarters[3];
+		quarters[1] = quarter_counts(lo) - quarters[3];
+		quarters[0] = 0x8888 - quarters[1] - quarters[2] - quarters[3];
+		
+		if (thumb == C64KOALA_THUMB_40X25) {
+			for (i = 0; i < 4; ++i)
+				counts[i] = (quarters[i] & 0xf) +
+				            (quarters[i] >> 4 & 0xf) +
+				            (quarters[i] >> 8 & 0xf) +
+				            (quarters[i] >> 12);
+			thumb_pixel(lanes, pal, counts, 5, row + 3*cardx);
+			continue;
+		}
+		for (q = 0; q < 4; ++q) {
+			for (i = 0; i < 4; ++i)
+				counts[i] = quarters[i] >> 4*q & 0xf;
+			out = row + 6*cardx + 3*(q & 1) + rowsize*(q >> 1);
+			thumb_pixel(lanes, pal, counts, 3, out);
+		}
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+/*
+ * thumb_row() four cards at a time. pshufb counts the crumbs of each value in
+ * every nibble of two cards' bitmaps at once, and pmaddubsw then weighs a
+ * card's four colors by their counts, a channel of a pixel at a time.
+ */
+__attribute__((target("ssse3")))
+static void thumb_row_ssse3(const struct rgb_table *t, int thumb,
+                            const struct c64koala *koala, int cardy,
+                            unsigned char *row, size_t rowsize)
+{
+	/* how many of a nibble's two crumbs are 1, 2 and 3 */
+	static const unsigned char crumbs[3][16] = {
+		{ 0, 1, 0, 0, 1, 2, 1, 1, 0, 1, 0, 0, 0, 1, 0, 0 },
+		{ 0, 0, 1, 0, 0, 0, 1, 0, 1, 1, 2, 1, 0, 0, 1, 0 },
+		{ 0, 0, 0, 1, 0, 0, 0, 1, 0, 0, 0, 1, 1, 1, 1, 2 }
+	};
+	/* a quarter's four counts, lined up with a card's four reds, greens and blues */
+	static const signed char quarter[4][16] = {
+		{  0,  1,  2,  3,  0,  1,  2,  3,  0,  1,  2,  3, -1, -1, -1, -1 },
+		{  4,  5,  6,  7,  4,  5,  6,  7,  4,  5,  6,  7, -1, -1, -1, -1 },
+		{  8,  9, 10, 11,  8,  9, 10, 11,  8,  9, 10, 11, -1, -1, -1, -1 },
+		{ 12, 13, 14, 15, 12, 13, 14, 15, 12, 13, 14, 15, -1, -1, -1, -1 }
+	};
+	/* four RGBX pixels to RGB: four in a row, or two in each of two rows */
+	static const signed char pack[2][16] = {
+		{ 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1 },
+		{ 0, 1, 2, 4, 5, 6, -1, -1, 8, 9, 10, 12, 13, 14, -1, -1 }
+	};
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m128i low_byte = _mm_set1_epi32(0xff);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bg = _mm_set1_epi8(koala->bg & 0x0f);
+	const __m128i r = _mm_loadu_si128((const __m128i *)t->r);
+	const __m128i g = _mm_loadu_si128((const __m128i *)t->g);
+	const __m128i b = _mm_loadu_si128((const __m128i *)t->b);
+	__m128i lut[3], colors[4], counts[4], sums[4], video, color, pal;
+	__m128i red, green, blue, left, right, bits, n, lo, hi;
+	unsigned char pixels[16];
+	int cardx, shift, i, k;
+	int32_t word;
+	
+	for (k = 0; k < 3; ++k)
+		lut[k] = _mm_loadu_si128((const __m128i *)crumbs[k]);
+	shift = thumb == C64KOALA_THUMB_40X25 ? 5 : 3;
+	for (cardx = 0; cardx < 40; cardx += 4) {
+		/* each card's colors, as 4 reds, 4 greens, 4 blues and 4 zeros */
+		memcpy(&word, &koala->video[cardy][cardx], sizeof(word));
+		video = _mm_cvtsi32_si128(word);
+		memcpy(&word, &koala->color[cardy][cardx], sizeof(word));
+		color = _mm_cvtsi32_si128(word);
+		pal = _mm_unpacklo_epi16(
+		        _mm_unpacklo_epi8(bg, _mm_and_si128(_mm_srli_epi16(video, 4), nibble)),
+		        _mm_unpacklo_epi8(_mm_and_si128(video, nibble), _mm_and_si128(color, nibble)));
+		red = _mm_shuffle_epi8(r, pal);
+		green = _mm_shuffle_epi8(g, pal);
+		blue = _mm_shuffle_epi8(b, pal);
+		lo = _mm_unpacklo_epi32(red, green);
+		hi = _mm_unpacklo_epi32(blue, zero);
+		colors[0] = _mm_unpacklo_epi64(lo, hi);
+		colors[1] = _mm_unpackhi_epi64(lo, hi);
+		lo = _mm_unpackhi_epi32(red, green);
+		hi = _mm_unpackhi_epi32(blue, zero);
+		colors[2] = _mm_unpacklo_epi64(lo, hi);
+		colors[3] = _mm_unpackhi_epi64(lo, hi);
+		
+		/*
+		 * Two cards' counts of crumbs 0 to 3, a byte each: per card at
+		 * bytes 0 and 8 for a 40x25 thumbnail, or per quarter of the
+		 * card at bytes 0, 4, 8 and 12 for an 80x50 one.
+		 */
+		for (i = 0; i < 2; ++i) {
+			bits = _mm_loadu_si128((const __m128i *)koala->bitmap[cardy][cardx + 2*i]);
+			left = _mm_and_si128(_mm_srli_epi16(bits, 4), nibble);
+			right = _mm_and_si128(bits, nibble);
+			if (thumb == C64KOALA_THUMB_40X25) {
+				for (k = 0; k < 3; ++k)
+					sums[k+1] = _mm_sad_epu8(_mm_add_epi8(
+					        _mm_shuffle_epi8(lut[k], left),
+					        _mm_shuffle_epi8(lut[k], right)), zero);
+				n = _mm_set1_epi64x(32);
+			} else {
+				/* the left nibble's count, plus 16 times the right's */
+				for (k = 0; k < 3; ++k) {
+					sums[k+1] = _mm_add_epi8(_mm_shuffle_epi8(lut[k], left),
+					        _mm_shuffle_epi8(_mm_slli_epi16(lut[k], 4), right));
+					sums[k+1] = _mm_add_epi8(sums[k+1], _mm_srli_epi32(sums[k+1], 8));
+					sums[k+1] = _mm_add_epi8(sums[k+1], _mm_srli_epi32(sums[k+1], 16));
+					sums[k+1] = _mm_and_si128(sums[k+1], low_byte);
+				}
+				n = _mm_set1_epi32(0x88);
+			}
+			sums[0] = _mm_sub_epi32(n, _mm_add_epi32(sums[1],
+			                                         _mm_add_epi32(sums[2], sums[3])));
+			n = _mm_or_si128(_mm_or_si128(sums[0], _mm_slli_epi32(sums[1], 8)),
+			                 _mm_or_si128(_mm_slli_epi32(sums[2], 16),
+			                              _mm_slli_epi32(sums[3], 24)));
+			if (thumb == C64KOALA_THUMB_40X25) {
+				counts[2*i] = counts[2*i+1] = n;
+				continue;
+			}
+			lo = _mm_and_si128(n, nibble);
+			hi = _mm_and_si128(_mm_srli_epi16(n, 4), nibble);
+			counts[2*i] = _mm_unpacklo_epi32(lo, hi);
+			counts[2*i+1] = _mm_unpackhi_epi32(lo, hi);
+		}
+		
+		if (thumb == C64KOALA_THUMB_40X25) {
+			for (i = 0; i < 4; ++i)
+				sums[i] = _mm_maddubs_epi16(colors[i], _mm_shuffle_epi8(counts[i],
+				        _mm_loadu_si128((const __m128i *)quarter[2 * (i & 1)])));
+			n = _mm_packus_epi16(
+			        _mm_srli_epi16(_mm_add_epi16(_mm_hadd_epi16(sums[0], sums[1]),
+			                                     _mm_set1_epi16(16)), shift),
+			        _mm_srli_epi16(_mm_add_epi16(_mm_hadd_epi16(sums[2], sums[3]),
+			                                     _mm_set1_epi16(16)), shift));
+			_mm_storeu_si128((__m128i *)pixels, _mm_shuffle_epi8(n,
+			        _mm_loadu_si128((const __m128i *)pack[0])));
+			memcpy(row + 3*cardx, pixels, 12);
+			continue;
+		}
+		for (i = 0; i < 4; ++i) {
+			for (k = 0; k < 4; ++k)
+				sums[k] = _mm_maddubs_epi16(colors[i], _mm_shuffle_epi8(counts[i],
+				        _mm_loadu_si128((const __m128i *)quarter[k])));
+			n = _mm_packus_epi16(
+			        _mm_srli_epi16(_mm_add_epi16(_mm_hadd_epi16(sums[0], sums[1]),
+			                                     _mm_set1_epi16(4)), shift),
+			        _mm_srli_epi16(_mm_add_epi16(_mm_hadd_epi16(sums[2], sums[3]),
+			                                     _mm_set1_epi16(4)), shift));
+			_mm_storeu_si128((__m128i *)pixels, _mm_shuffle_epi8(n,
+			        _mm_loadu_si128((const __m128i *)pack[1])));
+			memcpy(row + 6*(cardx + i), pixels, 6);
+			memcpy(row + rowsize + 6*(cardx + i), pixels + 8, 6);
+		}
+	}
+}
+#endif
+
+size_t c64koala_write_thumbnail(const struct c64koala_output *output,
+                                const struct c64koala *koala,
+                                unsigned char *buf)
+{
+	struct rgb_table table;
+	unsigned long long lanes[16];
+	unsigned char *row;
+	size_t len, rowsize;
+	int cardy;
+	
+	make_rgb_table(output->palette, &table);
+	thumb_lanes(output->palette, lanes);
+	len = pnm_header(output->format, (char *)buf,
+	                 thumb_width(output), thumb_height(output));
+	rowsize = sizeof(struct c64koala_rgb) * thumb_width(output);
+	for (cardy = 0; cardy < 25; ++cardy) {
+		row = buf + len + rowsize * thumb_per_card(output) * cardy;
+#ifdef HAVE_X86_SIMD
+		if (table.simd) {
+			thumb_row_ssse3(&table, output->thumb, koala, cardy, row,
+			                rowsize);
+			continue;
+		}
+#endif
+		thumb_row(lanes, output->thumb, koala, cardy, row, rowsize);
+	}
+	return len + rowsize * thumb_height(output);
+}
+
+/*
+ * An output format writes out a decoded image, scaled and in the output's
+ * palette, either from a whole decoded image or, if it can, from one decoded
+ * card row at a time.
+ */
+static const struct format {
+	const char *name;
+	size_t (*size)(const struct c64koala_output *output);
+	size_t (*write)(const struct c64koala_output *output,
+	                const unsigned char image[][C64KOALA_WIDTH],
+	                unsigned char *buf);
+	int (*stream)(const struct c64koala_ctx *ctx,
+	              const struct c64koala_output *output,
+	              const struct c64koala *koala, FILE *outfile);
+} formats[C64KOALA_NFORMATS] = {
+	{ "ppm", ppm_size, ppm_write, ppm_stream },
+	{ "png", png_size, png_write, NULL },
+	{ "qoi", qoi_size, qoi_write, qoi_stream },
+	{ "raw", raw_size, raw_write, raw_stream },
+	{ "bmp", bmp_size, bmp_write, bmp_stream },
+	{ "gif", gif_size, gif_write, NULL },
+	{ "pam", ppm_size, ppm_write, ppm_stream },
+};
+
+int c64koala_find_format(const char *name)
+{
+	int i;
+	for (i = 0; i < C64KOALA_NFORMATS; ++i)
+		if (!strcmp(formats[i].name, name))
+			return i;
+	return -1;
+}
+
+const char *c64koala_format_name(int format)
+{
+	return formats[format].name;
+}
+
+int c64koala_can_stream(int format)
+{
+	return formats[format].stream != NULL;
+}
+
+size_t c64koala_output_size(const struct c64koala_output *output)
+{
+	if (output->thumb)
+		return thumb_size(output);
+	return formats[output->format].size(output);
+}
+
+size_t
+c64koala_write_image(const struct c64koala_output *output,
+                     const unsigned char image[C64KOALA_HEIGHT][C64KOALA_WIDTH],
+                     unsigned char *buf)
+{
+	return formats[output->format].write(output, image, buf);
+}
+
+int c64koala_stream_image(const struct c64koala_ctx *ctx,
+                          const struct c64koala_output *output,
+                          const struct c64koala *koala, FILE *outfile)
+{
+	if (output->thumb || !formats[output->format].stream)
+		return -1;
+	return formats[output->format].stream(ctx, output, koala, outfile);
+}
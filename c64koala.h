@@ -0,0 +1,299 @@
+/*
+
+$Id$
+
+libc64koala, decode Commodore 64 KoalaPaint images
+Copyright 2009 Christopher Williams
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#ifndef C64KOALA_H
+#define C64KOALA_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The library keeps no global state and never allocates memory: everything a
+ * conversion needs lives in a struct c64koala_ctx, a struct c64koala_palette
+ * and buffers supplied by the caller. Contexts and palettes are only read
+ * once they have been set up, so any number of threads may share them.
+ */
+
+#define C64KOALA_WIDTH 160
+#define C64KOALA_HEIGHT 200
+
+/* the default color settings; see c64koala.c */
+#define C64KOALA_SATURATION 1.0
+#define C64KOALA_USCALE 0.1331
+#define C64KOALA_VSCALE 0.1331
+
+/* a Koala file, exactly as it is laid out on disk */
+struct c64koala {
+	unsigned char loadaddr[2];
+	unsigned char bitmap[25][40][8];
+	unsigned char video[25][40];
+	unsigned char color[25][40];
+	unsigned char bg;
+};
+
+/* packed, so that an array of these is laid out exactly like P6 pixel data */
+struct c64koala_rgb {
+	unsigned char r, g, b;
+};
+
+/* the size of a whole PPM as written by c64koala_to_ppm() */
+#define C64KOALA_PPM_SIZE \
+	(15 + sizeof(struct c64koala_rgb[C64KOALA_HEIGHT][C64KOALA_WIDTH]))
+
+/*
+ * Palette presets. The default palette is computed from the C64's hues and
+ * lumas; the others are fixed RGB tables from elsewhere.
+ */
+enum {
+	C64KOALA_PRESET_DEFAULT,
+	C64KOALA_PRESET_PEPTO,    /* Pepto's 2001 palette */
+	C64KOALA_PRESET_COLODORE, /* Pepto's Colodore palette */
+	C64KOALA_PRESET_VICE,     /* the VICE emulator's old default */
+	C64KOALA_NPRESETS
+};
+
+/* the settings a palette is computed from */
+struct c64koala_colors {
+	int preset;
+	float saturation; /* must be >= 0 */
+	float uscale, vscale; /* only used by C64KOALA_PRESET_DEFAULT */
+};
+
+#define C64KOALA_COLORS_DEFAULT \
+	{ C64KOALA_PRESET_DEFAULT, C64KOALA_SATURATION, \
+	  C64KOALA_USCALE, C64KOALA_VSCALE }
+
+/* the RGB value of each of the 16 C64 colors */
+struct c64koala_palette {
+	struct c64koala_colors colors;
+	struct c64koala_rgb rgb[16];
+};
+
+struct c64koala_ctx {
+	/* private */
+	void (*decode_card)(const struct c64koala_ctx *ctx,
+	                    const unsigned char *bits, const unsigned char *pal,
+	                    unsigned char *out, size_t stride);
+	unsigned char slots[256][4];
+};
+
+/* set up ctx for decoding */
+void c64koala_init(struct c64koala_ctx *ctx);
+
+/* returns the preset called name, such as "pepto", or -1 if there is none */
+int c64koala_find_preset(const char *name);
+const char *c64koala_preset_name(int preset);
+
+/* compute the palette for the given color settings */
+void c64koala_make_palette(struct c64koala_palette *palette,
+                           const struct c64koala_colors *colors);
+
+/*
+ * A palette cache hands out palettes that are shared by everyone asking for
+ * the same color settings, so each is computed only once. A palette handed
+ * out by c64koala_palette_get() stays valid and unchanged until it is given
+ * back with c64koala_palette_release(); only then may its slot be reused for
+ * other settings, least recently used first. Getting and releasing take a
+ * lock; using the palette does not.
+ */
+#define C64KOALA_PALETTE_CACHE_SIZE 16
+
+struct c64koala_palette_cache {
+	/* private */
+	pthread_mutex_t lock;
+	struct {
+		struct c64koala_palette palette;
+		int valid, refs;
+		unsigned long last_used;
+	} slots[C64KOALA_PALETTE_CACHE_SIZE];
+	unsigned long clock, hits, misses;
+};
+
+void c64koala_palette_cache_init(struct c64koala_palette_cache *cache);
+void c64koala_palette_cache_destroy(struct c64koala_palette_cache *cache);
+
+/* returns NULL if every palette in the cache is in use */
+const struct c64koala_palette *
+c64koala_palette_get(struct c64koala_palette_cache *cache,
+                     const struct c64koala_colors *colors);
+void c64koala_palette_release(struct c64koala_palette_cache *cache,
+                              const struct c64koala_palette *palette);
+
+/* how many c64koala_palette_get() calls found their palette cached or not */
+void c64koala_palette_cache_stats(struct c64koala_palette_cache *cache,
+                                  unsigned long *hits, unsigned long *misses);
+
+/*
+ * Fill koala with a pattern that makes any part of it that is not read in
+ * afterwards stand out, for decoding short files.
+ */
+void c64koala_mark_short(struct c64koala *koala);
+
+/*
+ * Decode card row cardy of a Koala image, that is scanlines 8*cardy to
+ * 8*cardy+7, into rows[][], one C64 color index (0..15) per pixel.
+ */
+void c64koala_decode_card_row(const struct c64koala_ctx *ctx,
+                              const struct c64koala *koala, int cardy,
+                              unsigned char rows[8][C64KOALA_WIDTH]);
+
+/* decode a whole Koala image into image[][], one C64 color index per pixel */
+void c64koala_decode(const struct c64koala_ctx *ctx,
+                     const struct c64koala *koala,
+                     unsigned char image[C64KOALA_HEIGHT][C64KOALA_WIDTH]);
+
+/* resolve nrows rows of C64 color indices to RGB */
+void c64koala_render_rgb(const struct c64koala_palette *palette,
+                         const unsigned char image[][C64KOALA_WIDTH],
+                         int nrows,
+                         struct c64koala_rgb out[][C64KOALA_WIDTH]);
+
+/*
+ * Write a PPM of a Koala image to buf, which must hold C64KOALA_PPM_SIZE
+ * bytes. Returns the number of bytes written.
+ */
+size_t c64koala_to_ppm(const struct c64koala_ctx *ctx,
+                       const struct c64koala_palette *palette,
+                       const struct c64koala *koala, unsigned char *buf);
+
+/*
+ * Like c64koala_to_ppm(), but decode the image only once and write a PPM of it
+ * in each of the npalettes palettes, palettes[i] to bufs[i]. Returns the
+ * number of bytes written to each buffer.
+ */
+size_t c64koala_to_ppms(const struct c64koala_ctx *ctx,
+                        const struct c64koala_palette *const palettes[],
+                        int npalettes, const struct c64koala *koala,
+                        unsigned char *const bufs[]);
+
+/*
+ * Write a Koala image to outfile as a PPM one card row at a time, without
+ * ever holding more than 8 scanlines. Returns nonzero on failure.
+ */
+int c64koala_stream_ppm(const struct c64koala_ctx *ctx,
+                        const struct c64koala_palette *palette,
+                        const struct c64koala *koala, FILE *outfile);
+
+/* output formats */
+enum {
+	C64KOALA_FORMAT_PPM,
+	C64KOALA_FORMAT_PNG, /* 4-bit indexed */
+	C64KOALA_FORMAT_QOI,
+	C64KOALA_FORMAT_RAW, /* the color indices, two pixels per byte, no header */
+	C64KOALA_FORMAT_BMP, /* 4-bit indexed */
+	C64KOALA_FORMAT_GIF,
+	C64KOALA_FORMAT_PAM, /* the same RGB pixels as a PPM, with a PAM header */
+	C64KOALA_NFORMATS
+};
+
+#define C64KOALA_MAX_SCALE 16
+
+/*
+ * Thumbnails, as opposed to whole images, have one pixel in the average color
+ * of each card, or of each 2x4 pixel quarter of one.
+ */
+enum {
+	C64KOALA_THUMB_NONE,
+	C64KOALA_THUMB_40X25,
+	C64KOALA_THUMB_80X50
+};
+
+/*
+ * A frame is as much of the C64's screen as a PAL TV shows: the picture, its
+ * pixels twice as wide, amid a border of one color. Frames are scaled like
+ * the pictures in them.
+ */
+#define C64KOALA_FRAME_WIDTH 384
+#define C64KOALA_FRAME_HEIGHT 272
+#define C64KOALA_BORDER_NONE (-1)
+
+/* how hard formats that compress try */
+enum {
+	C64KOALA_LEVEL_FAST,
+	C64KOALA_LEVEL_BEST
+};
+
+/*
+ * How to write out a decoded image. Any number of outputs can be written
+ * from the same decoded image.
+ */
+struct c64koala_output {
+	int format;
+	int scale; /* each pixel becomes scale by scale pixels, 1..MAX_SCALE */
+	int wide; /* nonzero to make pixels twice as wide, as on a C64's screen */
+	int level; /* C64KOALA_LEVEL_FAST or C64KOALA_LEVEL_BEST */
+	int thumb; /* a C64KOALA_THUMB_*; thumbnails are not scaled or framed */
+	int crt; /* nonzero to filter PPMs and PAMs the way a PAL TV shows them */
+	int border; /* the C64 color to frame PPMs and PAMs in, or BORDER_NONE */
+	const struct c64koala_palette *palette;
+};
+
+/* returns the format called name, such as "ppm", or -1 if there is none */
+int c64koala_find_format(const char *name);
+const char *c64koala_format_name(int format);
+
+/*
+ * The size of the buffer c64koala_write_image() needs for output. Formats that
+ * compress use part of it as scratch space, so it must be aligned the way
+ * malloc() aligns memory.
+ */
+size_t c64koala_output_size(const struct c64koala_output *output);
+
+/*
+ * Write an image decoded by c64koala_decode() to buf as output says, which must
+ * not ask for a thumbnail. Returns the number of bytes written.
+ */
+size_t
+c64koala_write_image(const struct c64koala_output *output,
+                     const unsigned char image[C64KOALA_HEIGHT][C64KOALA_WIDTH],
+                     unsigned char *buf);
+
+/*
+ * Write a thumbnail of a Koala image to buf as output says, straight from the
+ * bitmap, without decoding it. Only C64KOALA_FORMAT_PPM and C64KOALA_FORMAT_PAM
+ * can hold thumbnails. Returns the number of bytes written.
+ */
+size_t c64koala_write_thumbnail(const struct c64koala_output *output,
+                                const struct c64koala *koala,
+                                unsigned char *buf);
+
+/*
+ * Write a Koala image to outfile as output says, one card row at a time.
+ * Returns nonzero on failure, or if the output is a thumbnail or its format
+ * cannot be streamed, in which case nothing is written.
+ */
+int c64koala_can_stream(int format);
+int c64koala_stream_image(const struct c64koala_ctx *ctx,
+                          const struct c64koala_output *output,
+                          const struct c64koala *koala, FILE *outfile);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -24,149 +24,111 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 
-/*
- * The Commodore 64 version of Koala Painter used a fairly simple file format:
- * A two-byte load address, followed immediately by
- * 8000 bytes of raw bitmap data,
- * 1000 bytes of raw "Video Matrix" data,
- * 1000 bytes of raw "Color RAM" data,
- * and a one-byte Background Color field.
- *
- * The screen is divided into 4x8 pixel areas called "cards". Cards are arranged
- * left-to-right, top-to-bottom, in row-major order.
- *
- * The video matrix data is arranged in card order, with one byte per card.
- * Each byte defines two colors that can be used in that card, one in the high
- * nibble, and one in the low nibble.
- *
- * The color RAM is similar to the video matrix data, except that each byte
- * contains only one color that can be used in that card. Only the low nibble
- * is used.
- *
- * The bitmap data is arranged in card order, such that it fills up one card at
- * a time. Each byte of bitmap data consists of four two-bit pixels, with each
- * pixel being one of 4 colors:
- *    00: global background color
- *    01: upper nibble of video RAM for this card
- *    10: lower nibble of video RAM for this card
- *    11: lower nibble of color RAM for this card
- */
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
 
-/* http://www.pepto.de/projects/colorvic/ defines both USCALE and VSCALE
- * as 34.0081334493 / 255 (0.13337)
- * it also uses the following formula to convert YUV to RGB:
- * R = Y             + 1,140 * V
- * G = Y - 0,396 * U - 0,581 * V
- * B = Y + 2,029 * U
- *
- * while I'm using this formula from wikipedia:
- * R = Y               + 1.13983 * V
- * G = Y - 0.39465 * U - 0.58060 * V
- * B = Y + 2.03211 * U
- */
-#define USCALE 0.1331
-#define VSCALE 0.1331
-#define SATURATION 1.0
-
-float saturation;
-
-/* colors are from http://www.pepto.de/projects/colorvic/ */
-struct c64_color {
-	 /* angle is [0..15], luma is [0..32], saturation is [0..1] */
-	int angle, luma, saturation;
-} c64_colors[16] = {
-	{  0,  0, 0 }, /* black */
-	{  0, 32, 0 }, /* white */
-
-	{  5, 10, 1 }, /* red */
-	{ 13, 20, 1 }, /* cyan */
-
-	{  2, 12, 1 }, /* purple */
-	{ 10, 16, 1 }, /* green */
-
-	{  0,  8, 1 }, /* blue */
-	{  8, 24, 1 }, /* yellow */
-
-	{  6, 12, 1 }, /* orange */
-	{  7,  8, 1 }, /* brown */
-	{  5, 16, 1 }, /* light red */
-	{  0, 10, 0 }, /* dark grey */
-	{  0, 15, 0 }, /* grey */
-	{ 10, 24, 1 }, /* light green */
-	{  0, 15, 1 }, /* light blue */
-	{  0, 20, 0 }, /* light grey */
-};
+#ifdef __linux__
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+#endif
 
-/* note: the y component in yuv_color is luma (Y'), which is gamma-compressed */
-struct yuv_color {
-	float y, u, v;
-};
+#include "c64koala.h"
 
-struct rgb_color {
-	int r, g, b;
+/* an image to write for every input */
+struct output {
+	const char *template; /* NULL for standard output */
+	int format, scale, wide, level, thumb, crt, border;
+	struct c64koala_colors colors;
 };
 
-void c64_to_yuv(struct c64_color *c64, struct yuv_color *yuv, float uscale, float vscale)
-{
-	yuv->y = c64->luma / 32.;
-	yuv->u = c64->saturation * saturation * uscale * cos(c64->angle*M_PI/8);
-	yuv->v = c64->saturation * saturation * vscale * sin(c64->angle*M_PI/8);
-}
-
-/* from http://en.wikipedia.org/wiki/YUV */
-void yuv_to_rgb(struct yuv_color *yuv, struct rgb_color *rgb)
-{
-	float r,g,b;
-	r = (yuv->y +                      1.13983 * yuv->v);
-	g = (yuv->y + -0.39465 * yuv->u + -0.58060 * yuv->v);
-	b = (yuv->y +  2.03211 * yuv->u);
-	
-#define BOUND(x) do {                      \
-if (x < 0) {                               \
-	x = 0;                             \
-	/*fprintf(stderr, #x " < 0!\n");*/ \
-} else if (x > 1) {                        \
-	x = 1;                             \
-	/*fprintf(stderr, #x " > 1!\n");*/ \
-}} while (0)
-
-	BOUND(r);
-	BOUND(g);
-	BOUND(b);
-	rgb->r = 255*r + 0.5;
-	rgb->g = 255*g + 0.5;
-	rgb->b = 255*b + 0.5;
-}
-
-void c64_to_rgb(struct c64_color *c64, struct rgb_color *rgb, float uscale, float vscale)
-{
-	struct yuv_color yuv;
-	c64_to_yuv(c64, &yuv, uscale, vscale);
-	yuv_to_rgb(&yuv, rgb);
-}
-
-struct rgb_color c64colors[16];
-
-void init_colors()
-{
-	int i;
-	for (i = 0; i < 16; ++i)
-		c64_to_rgb(&c64_colors[i], &c64colors[i], USCALE, VSCALE);
-}
+#define MAX_OUTPUTS 16
+struct output outputs[MAX_OUTPUTS];
+int noutputs = 0;
+int to_stdout = 0; /* no -o, so all the outputs go to standard output */
+struct c64koala_ctx ctx;
+struct c64koala_palette_cache palette_cache;
+/*
+ * The palette of each output. Color settings are fixed for the run, so these
+ * are looked up once before converting anything, and are then read without
+ * taking the cache's lock.
+ */
+const struct c64koala_palette *palettes[MAX_OUTPUTS];
+struct c64koala_palette own_palettes[MAX_OUTPUTS]; /* for when the cache is full */
 
 char *argv0;
 
 void usage(void)
 {
 	fprintf(stderr,
-	        "Usage: %s [-hL] [-s saturation] [koala_file]\n"
+	        "Usage: %s [-hL] [-s saturation] [-f list_file]\n"
+	        "       [[-F format] [-x scale] [-a] [-c] [-b color] [-z fast|best]\n"
+	        "        [-t size] [-p palette[,palette...]] -o output_template]...\n"
+	        "       [koala_file...]\n"
 		"  -h             Show this help message and exit\n"
 	        "  -L             Show license information and exit\n"
-	        "  -s saturation  Set the output saturation. Value must be >= 0\n",
+	        "  -s saturation  Set the output saturation. Value must be >= 0\n"
+	        "  -F format      Write images in this format: ppm, pam, png, qoi, bmp,\n"
+	        "                 gif, or raw for just the color indices, two pixels per\n"
+	        "                 byte\n"
+	        "  -x scale       Scale images up by this whole number, up to 16\n"
+	        "  -a             Make pixels twice as wide as they are high, as the C64\n"
+	        "                 shows them: 320x200 at scale 1\n"
+	        "  -c             Filter images the way a PAL TV shows them: colors\n"
+	        "                 bleed into their neighbors and the line above, and\n"
+	        "                 scaled images get dark scanlines. Only for ppm and\n"
+	        "                 pam, and not for thumbnails\n"
+	        "  -b color       Frame images in a border of this color, 0 to 15 or\n"
+	        "                 a name such as lightblue, as a PAL TV shows the\n"
+	        "                 C64's screen: 384x272 at scale 1, with the picture\n"
+	        "                 as -a makes it. off for no border. Only for ppm\n"
+	        "                 and pam, and not for thumbnails\n"
+	        "  -z fast|best   Compress PNGs for speed (the default) or for size\n"
+	        "  -t size        Write thumbnails instead of whole images: 40x25, one\n"
+	        "                 pixel in the average color of each 4x8 pixel card,\n"
+	        "                 80x50, one for each quarter of a card, or off. They\n"
+	        "                 are computed without decoding, are not scaled, and\n"
+	        "                 can only be written as ppm or pam\n"
+	        "  -p palettes    Write each image in each of these palettes: default,\n"
+	        "                 pepto, colodore or vice\n"
+	        "  -f list_file   Also convert the files named in list_file, one per\n"
+	        "                 line (\"-\" reads the list from standard input)\n"
+	        "  -o template    Write each image to a file named by template instead\n"
+	        "                 of standard output. In template, %%n is replaced by\n"
+	        "                 the input file name without directory and extension,\n"
+	        "                 %%i by the input's number counting from 0, %%p by the\n"
+	        "                 palette name, and %%%% by %%. No two images may go to\n"
+	        "                 the same file, so with more than one input the\n"
+	        "                 template must use %%n, or %%i if names repeat, and\n"
+	        "                 with more than one palette %%p.\n"
+	        "                 -F, -x, -a, -c, -b, -z, -t and -p apply to the -o\n"
+	        "                 options after them, and each -o adds an output, so\n"
+	        "                 one decode of each input can be written in several\n"
+	        "                 formats, scales and palettes. Without -o, all images are\n"
+	        "                 written to standard output one after another, in\n"
+	        "                 input order and then palette order\n"
+	        "  -j threads     Convert files with this many threads. The default, 0,\n"
+	        "                 uses one thread per CPU\n"
+	        "  -u             Do file I/O through io_uring on a single thread, keeping\n"
+	        "                 many files in flight. Falls back to -j threads where\n"
+	        "                 io_uring is not available\n"
+	        "  -S             Stream each image out 8 scanlines at a time instead of\n"
+	        "                 converting it as a whole first. Ignored with -u, and\n"
+	        "                 for PNGs and GIFs, which are always compressed whole\n"
+	        "  -v             Report per-thread throughput and palette cache hits on\n"
+	        "                 standard error\n",
 	        argv0);
 }
 
@@ -187,13 +149,155 @@ void license(void)
 	        "GNU General Public License for more details.\n");
 }
 
-char *koalafilename = NULL;
+/* input filenames; NULL stands for standard input */
+char **koalafilenames = NULL;
+int nkoalafiles = 0;
+int nthreads = 0;
+int use_uring = 0;
+int streaming = 0;
+int verbose = 0;
+
+void add_koalafile(char *filename)
+{
+	static int size = 0;
+	if (nkoalafiles == size) {
+		size = size ? 2*size : 64;
+		koalafilenames = realloc(koalafilenames,
+		                         size * sizeof(*koalafilenames));
+		if (!koalafilenames) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(1);
+		}
+	}
+	koalafilenames[nkoalafiles++] = filename;
+}
+
+void read_file_list(const char *listfilename)
+{
+	FILE *listfile;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	
+	if (strcmp("-", listfilename)) {
+		listfile = fopen(listfilename, "r");
+		if (!listfile) {
+			fprintf(stderr, "%s: could not open \"%s\" for reading\n", argv0, listfilename);
+			exit(1);
+		}
+	} else {
+		listfile = stdin;
+	}
+	while ((len = getline(&line, &size, listfile)) != -1) {
+		if (len && line[len-1] == '\n')
+			line[--len] = '\0';
+		if (len)
+			add_koalafile(strdup(line));
+	}
+	free(line);
+	if (listfile != stdin)
+		fclose(listfile);
+}
+
+/*
+ * Parse the comma separated palette presets in list into presets[]. Returns
+ * how many there are.
+ */
+int parse_palettes(char *list, int presets[MAX_OUTPUTS])
+{
+	char *name;
+	int n = 0;
+	for (name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+		if (n == MAX_OUTPUTS) {
+			fprintf(stderr, "%s: too many palettes\n", argv0);
+			exit(1);
+		}
+		presets[n] = c64koala_find_preset(name);
+		if (presets[n] < 0) {
+			fprintf(stderr, "%s: unknown palette \"%s\"\n", argv0, name);
+			exit(1);
+		}
+		++n;
+	}
+	if (!n) {
+		fprintf(stderr, "%s: no palette given\n", argv0);
+		exit(1);
+	}
+	return n;
+}
+
+/* the C64's colors, in order */
+const char *const color_names[16] = {
+	"black", "white", "red", "cyan", "purple", "green", "blue", "yellow",
+	"orange", "brown", "lightred", "darkgrey", "grey", "lightgreen",
+	"lightblue", "lightgrey"
+};
+
+/* parse a border color: a number, a name, or off for C64KOALA_BORDER_NONE */
+int parse_border(const char *arg)
+{
+	char *end;
+	long color;
+	int i;
+	if (!strcmp(arg, "off"))
+		return C64KOALA_BORDER_NONE;
+	for (i = 0; i < 16; ++i)
+		if (!strcmp(arg, color_names[i]))
+			return i;
+	color = strtol(arg, &end, 10);
+	if (end == arg || *end || color < 0 || color > 15) {
+		fprintf(stderr, "%s: border color must be 0 to 15, a color name or off\n",
+		        argv0);
+		exit(1);
+	}
+	return color;
+}
+
+/* add an output like out in each of the npresets palettes in presets[] */
+void add_outputs(const struct output *out, const int *presets, int npresets)
+{
+	int i;
+	if (npresets > 1 && out->template && !strstr(out->template, "%p")) {
+		fprintf(stderr, "%s: with more than one palette, the output template must use %%p\n", argv0);
+		exit(1);
+	}
+	if (out->thumb && out->format != C64KOALA_FORMAT_PPM &&
+	    out->format != C64KOALA_FORMAT_PAM) {
+		fprintf(stderr, "%s: thumbnails can only be written as ppm or pam\n", argv0);
+		exit(1);
+	}
+	if (out->crt && !out->thumb && out->format != C64KOALA_FORMAT_PPM &&
+	    out->format != C64KOALA_FORMAT_PAM) {
+		fprintf(stderr, "%s: -c only applies to ppm and pam\n", argv0);
+		exit(1);
+	}
+	if (out->border != C64KOALA_BORDER_NONE && !out->thumb &&
+	    out->format != C64KOALA_FORMAT_PPM && out->format != C64KOALA_FORMAT_PAM) {
+		fprintf(stderr, "%s: -b only applies to ppm and pam\n", argv0);
+		exit(1);
+	}
+	for (i = 0; i < npresets; ++i) {
+		if (noutputs == MAX_OUTPUTS) {
+			fprintf(stderr, "%s: too many outputs\n", argv0);
+			exit(1);
+		}
+		outputs[noutputs] = *out;
+		outputs[noutputs++].colors.preset = presets[i];
+	}
+}
 
 int getargs(int argc, char *argv[])
 {
-	int opt;
-	saturation = SATURATION;
-	while ((opt = getopt(argc, argv, "hLs:")) != -1) {
+	struct output out = {
+		NULL, C64KOALA_FORMAT_PPM, 1, 0, C64KOALA_LEVEL_FAST,
+		C64KOALA_THUMB_NONE, 0, C64KOALA_BORDER_NONE, C64KOALA_COLORS_DEFAULT
+	};
+	int presets[MAX_OUTPUTS] = { C64KOALA_PRESET_DEFAULT };
+	int npresets = 1, pending = 0;
+	float saturation = C64KOALA_SATURATION;
+	int opt, i;
+	char *listfilename = NULL;
+	while ((opt = getopt(argc, argv, "hLs:F:x:acb:z:t:p:f:o:j:uSv")) != -1) {
 		switch (opt) {
 		case 'h':
 			usage();
@@ -209,104 +313,1171 @@ int getargs(int argc, char *argv[])
 				exit(1);
 			}
 			break;
+		case 'F':
+			out.format = c64koala_find_format(optarg);
+			if (out.format < 0) {
+				fprintf(stderr, "%s: unknown format \"%s\"\n",
+				 argv0, optarg);
+				exit(1);
+			}
+			pending = 1;
+			break;
+		case 'x':
+			out.scale = atoi(optarg);
+			if (out.scale < 1 || out.scale > C64KOALA_MAX_SCALE) {
+				fprintf(stderr, "%s: scale must be 1 to %d\n",
+				 argv0, C64KOALA_MAX_SCALE);
+				exit(1);
+			}
+			pending = 1;
+			break;
+		case 'a':
+			out.wide = 1;
+			pending = 1;
+			break;
+		case 'c':
+			out.crt = 1;
+			pending = 1;
+			break;
+		case 'b':
+			out.border = parse_border(optarg);
+			pending = 1;
+			break;
+		case 'z':
+			if (!strcmp(optarg, "fast")) {
+				out.level = C64KOALA_LEVEL_FAST;
+			} else if (!strcmp(optarg, "best")) {
+				out.level = C64KOALA_LEVEL_BEST;
+			} else {
+				fprintf(stderr, "%s: compression must be fast or best\n",
+				 argv0);
+				exit(1);
+			}
+			pending = 1;
+			break;
+		case 't':
+			if (!strcmp(optarg, "40x25")) {
+				out.thumb = C64KOALA_THUMB_40X25;
+			} else if (!strcmp(optarg, "80x50")) {
+				out.thumb = C64KOALA_THUMB_80X50;
+			} else if (!strcmp(optarg, "off")) {
+				out.thumb = C64KOALA_THUMB_NONE;
+			} else {
+				fprintf(stderr, "%s: thumbnail size must be 40x25, 80x50 or off\n",
+				 argv0);
+				exit(1);
+			}
+			pending = 1;
+			break;
+		case 'p':
+			npresets = parse_palettes(optarg, presets);
+			pending = 1;
+			break;
+		case 'f':
+			listfilename = optarg;
+			break;
+		case 'o':
+			out.template = optarg;
+			add_outputs(&out, presets, npresets);
+			pending = 0;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 0) {
+				fprintf(stderr, "%s: threads must be >= 0\n",
+				 argv0);
+				exit(1);
+			}
+			break;
+		case 'u':
+			use_uring = 1;
+			break;
+		case 'S':
+			streaming = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
 		default: /* '?' */
 			usage();
 			exit(1);
 		}
 	}
-	if (optind < argc - 1) {
-		fprintf(stderr, "%s: too many filenames\n", argv0);
-		usage();
+	if (!noutputs) {
+		to_stdout = 1;
+		add_outputs(&out, presets, npresets);
+	} else if (pending) {
+		fprintf(stderr, "%s: -F, -x, -a, -c, -b, -z, -t and -p must come before the -o they apply to\n", argv0);
 		exit(1);
-	} else if (optind == argc - 1 && strcmp("-", argv[optind])) {
-		koalafilename = argv[optind];
 	}
+	for (i = 0; i < noutputs; ++i)
+		outputs[i].colors.saturation = saturation;
+	/* the io_uring loop writes whole images */
+	if (use_uring)
+		streaming = 0;
+	
+	for (; optind < argc; ++optind)
+		add_koalafile(strcmp("-", argv[optind]) ? argv[optind] : NULL);
+	if (listfilename)
+		read_file_list(listfilename);
+	else if (!nkoalafiles)
+		add_koalafile(NULL);
 	return 0;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Expand the -o template for input number n in the given palette into buf.
+ * Returns -1 if the result does not fit.
+ */
+int expand_template(char *buf, size_t size, const char *template,
+                    const char *koalafilename, int n, const char *palettename)
 {
-	FILE *koalafile;
-	unsigned char loadaddr[2];
-	char bitmap[25][40][8];
-	char video[25][40];
-	char color[25][40];
-	char bg;
-	char outbitmap[200][40]; /* bitmap, re-arranged by scan order */
-	struct rgb_color colors[4];
-	struct rgb_color outimage[200][160];
-	struct rgb_color outcolor;
-	int x, y;
-	int cardx, cardy;
+	const char *name, *ext;
+	size_t len = 0;
+	int l;
+	
+	if (koalafilename) {
+		name = strrchr(koalafilename, '/');
+		name = name ? name + 1 : koalafilename;
+	} else {
+		name = "stdin";
+	}
+	ext = strrchr(name, '.');
+	if (!ext || ext == name)
+		ext = name + strlen(name);
+	
+	for (; *template; ++template) {
+		if (*template != '%' || !template[1]) {
+			l = 1;
+			if (len + l < size)
+				buf[len] = *template;
+		} else if (*++template == 'n') {
+			l = ext - name;
+			if (len + l < size)
+				memcpy(buf + len, name, l);
+		} else if (*template == 'i') {
+			l = snprintf(buf + len, len < size ? size - len : 0, "%d", n);
+		} else if (*template == 'p') {
+			l = strlen(palettename);
+			if (len + l < size)
+				memcpy(buf + len, palettename, l);
+		} else {
+			l = 1;
+			if (len + l < size)
+				buf[len] = *template;
+		}
+		len += l;
+	}
+	if (len >= size)
+		return -1;
+	buf[len] = '\0';
+	return 0;
+}
+
+/* input number n's file name, as given */
+const char *input_name(int n)
+{
+	return koalafilenames[n] ? koalafilenames[n] : "-";
+}
+
+/* an output file name, and the number of the input written to it */
+struct output_name {
+	char *name;
+	int n;
+};
+
+int compare_output_names(const void *a, const void *b)
+{
+	const struct output_name *x = a, *y = b;
+	int c = strcmp(x->name, y->name);
+	return c ? c : x->n - y->n;
+}
+
+/*
+ * Expand the name of every output file up front and fail if two are the
+ * same: one image would be lost, or with threads, the file mangled by two
+ * writers at once. Names too long to expand are reported when written.
+ */
+void check_output_names(void)
+{
+	struct output_name *names;
+	char buf[4096];
+	size_t count = 0, k;
+	int n, i;
+	
+	if (to_stdout)
+		return;
+	names = malloc((size_t)nkoalafiles * noutputs * sizeof(*names));
+	if (!names) {
+		fprintf(stderr, "%s: out of memory\n", argv0);
+		exit(1);
+	}
+	for (n = 0; n < nkoalafiles; ++n) {
+		for (i = 0; i < noutputs; ++i) {
+			if (expand_template(buf, sizeof(buf), outputs[i].template,
+			                    koalafilenames[n], n,
+			                    c64koala_preset_name(outputs[i].colors.preset)))
+				continue;
+			names[count].name = strdup(buf);
+			if (!names[count].name) {
+				fprintf(stderr, "%s: out of memory\n", argv0);
+				exit(1);
+			}
+			names[count++].n = n;
+		}
+	}
+	qsort(names, count, sizeof(*names), compare_output_names);
+	for (k = 1; k < count; ++k) {
+		if (strcmp(names[k-1].name, names[k].name))
+			continue;
+		if (names[k-1].n == names[k].n)
+			fprintf(stderr, "%s: two outputs of \"%s\" would both be written to \"%s\"\n",
+			        argv0, input_name(names[k].n), names[k].name);
+		else
+			fprintf(stderr, "%s: \"%s\" and \"%s\" would both be written to \"%s\"; use %%i in the output template\n",
+			        argv0, input_name(names[k-1].n), input_name(names[k].n),
+			        names[k].name);
+		exit(1);
+	}
+	for (k = 0; k < count; ++k)
+		free(names[k].name);
+	free(names);
+}
+
+/* whether output number i is streamed out by put_image() */
+int streamed(int i)
+{
+	return streaming && !outputs[i].thumb &&
+	       c64koala_can_stream(outputs[i].format);
+}
+
+/* how the library is to write output number i */
+void get_output(int i, const struct c64koala_palette *palette,
+                struct c64koala_output *output)
+{
+	output->format = outputs[i].format;
+	output->scale = outputs[i].scale;
+	output->wide = outputs[i].wide;
+	output->level = outputs[i].level;
+	output->thumb = outputs[i].thumb;
+	output->crt = outputs[i].crt;
+	output->border = outputs[i].border;
+	output->palette = palette;
+}
+
+/* buffers for converting one image, reused from one file to the next */
+struct converter {
+	struct c64koala koala;
+	/* the decoded image, shared by all the outputs */
+	unsigned char image[C64KOALA_HEIGHT][C64KOALA_WIDTH];
+	unsigned char *out[MAX_OUTPUTS];
+	size_t outlen[MAX_OUTPUTS];
+	char outfilename[4096];
+	void *map; /* the mapped input file, if it was mapped */
+	const struct c64koala *loaded; /* with -S, the input still to be streamed */
+	char *filebuf; /* with -S, the buffer for output files */
+};
+
+/*
+ * Streamed images are written a row at a time, and a large image written to a
+ * file through stdio's usual buffer would take a system call for every row.
+ */
+#define FILE_BLOCK (256 << 10)
+
+struct converter *new_converter(void)
+{
+	struct converter *conv = calloc(1, sizeof(*conv));
+	struct c64koala_output output;
+	int i, failed = !conv;
+	
+	for (i = 0; !failed && i < noutputs; ++i) {
+		if (streamed(i))
+			continue;
+		get_output(i, NULL, &output);
+		conv->out[i] = malloc(c64koala_output_size(&output));
+		failed = !conv->out[i];
+	}
+	if (!failed && streaming && !to_stdout) {
+		conv->filebuf = malloc(FILE_BLOCK);
+		failed = !conv->filebuf;
+	}
+	if (failed) {
+		fprintf(stderr, "%s: out of memory\n", argv0);
+		exit(1);
+	}
+	return conv;
+}
+
+void free_converter(struct converter *conv)
+{
+	int i;
+	if (!conv)
+		return;
+	for (i = 0; i < noutputs; ++i)
+		free(conv->out[i]);
+	free(conv->filebuf);
+	free(conv);
+}
+
+void warn_short_koala(const char *koalafilename)
+{
+	if (koalafilename)
+		fprintf(stderr, "%s: koala file \"%s\" is too short. Output may be corrupt.\n", argv0, koalafilename);
+	else
+		fprintf(stderr, "%s: koala file is too short. Output may be corrupt.\n", argv0);
+}
+
+/*
+ * Read a Koala file from fd into conv->koala, filling in whatever is missing
+ * from a short file with a pattern that makes it stand out.
+ */
+const struct c64koala *read_koala(struct converter *conv, int fd,
+                               const char *koalafilename)
+{
+	struct c64koala *koala = &conv->koala;
+	size_t len = 0;
+	ssize_t n;
+	
+	c64koala_mark_short(koala);
+	while (len < sizeof(*koala)) {
+		n = read(fd, (unsigned char *)koala + len, sizeof(*koala) - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	if (len != sizeof(*koala))
+		warn_short_koala(koalafilename);
+	return koala;
+}
+
+/*
+ * Load a Koala file (NULL is standard input). A regular file that is long
+ * enough is mapped and decoded in place; anything else, such as a pipe or a
+ * short file, is read into conv->koala. Release it with unload_koala().
+ * Returns NULL on failure.
+ */
+const struct c64koala *load_koala(struct converter *conv, const char *koalafilename)
+{
+	const struct c64koala *koala;
+	struct stat st;
+	int fd;
 	
-	argv0 = argv[0];
-	getargs(argc, argv);
 	if (koalafilename) {
-		koalafile = fopen(koalafilename, "rb");
-		if (!koalafile) {
+		fd = open(koalafilename, O_RDONLY);
+		if (fd < 0) {
 			fprintf(stderr, "%s: could not open \"%s\" for reading\n", argv0, koalafilename);
-			return -1;
+			return NULL;
 		}
 	} else {
-		koalafile = stdin;
+		fd = STDIN_FILENO;
 	}
 	
-	init_colors();
+	conv->map = NULL;
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+	    st.st_size >= (off_t)sizeof(*koala) && lseek(fd, 0, SEEK_CUR) == 0) {
+		conv->map = mmap(NULL, sizeof(*koala), PROT_READ,
+		                 MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		if (conv->map == MAP_FAILED)
+			conv->map = NULL;
+	}
+	koala = conv->map ? conv->map : read_koala(conv, fd, koalafilename);
 	
-	/* set the colors and bitmap to indicate short files */
-	memset(bitmap, 0x1b, sizeof(bitmap));
-	memset(video, 0x25, sizeof(video));
-	memset(color, 0x06, sizeof(color));
-	bg = 0x00;
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return koala;
+}
+
+void unload_koala(struct converter *conv)
+{
+	if (conv->map)
+		munmap(conv->map, sizeof(struct c64koala));
+	conv->map = NULL;
+	conv->loaded = NULL;
+}
+
+/*
+ * Decode koala once and write it into conv->out[] for every output, except
+ * for those that put_image() streams out if stream is set. Thumbnails need no
+ * decoding, so an input that only has thumbnails written is never decoded.
+ */
+void render_outputs(struct converter *conv, const struct c64koala *koala,
+                    int stream)
+{
+	struct c64koala_output output;
+	int i, decoded = 0;
 	
-	if (!(fread(loadaddr, 2, 1, koalafile) &&
-	      fread(bitmap, 8000, 1, koalafile) &&
-	      fread(video, 1000, 1, koalafile) &&
-	      fread(color, 1000, 1, koalafile) &&
-	      fread(&bg, 1, 1, koalafile))) {
-		fprintf(stderr, "%s: koala file is too short. Output may be corrupt.\n", argv0);
+	for (i = 0; i < noutputs; ++i) {
+		if (stream && streamed(i))
+			continue;
+		get_output(i, palettes[i], &output);
+		if (output.thumb) {
+			conv->outlen[i] = c64koala_write_thumbnail(&output, koala,
+			                                           conv->out[i]);
+			continue;
+		}
+		if (!decoded) {
+			c64koala_decode(&ctx, koala, conv->image);
+			decoded = 1;
+		}
+		conv->outlen[i] = c64koala_write_image(&output, conv->image,
+		                                       conv->out[i]);
 	}
+}
+
+/*
+ * Convert a Koala file (NULL is standard input) into conv->out[] or, with -S,
+ * just load it for put_image() to stream out. Returns nonzero on failure.
+ */
+int convert(struct converter *conv, const char *koalafilename)
+{
+	const struct c64koala *koala;
+	
+	koala = load_koala(conv, koalafilename);
+	if (!koala)
+		return -1;
 	
 #if 0
-	fprintf(stderr, "load address: 0x%02x%02x\n", loadaddr[1], loadaddr[0]);
-	fprintf(stderr, "background color: 0x%02x\n", (unsigned char)bg);
+	fprintf(stderr, "load address: 0x%02x%02x\n", koala->loadaddr[1], koala->loadaddr[0]);
+	fprintf(stderr, "background color: 0x%02x\n", koala->bg);
 #endif
-	colors[0] = c64colors[(unsigned char)bg & 0x0f];
-	
-	for (cardy = 0; cardy < 25; ++cardy) {
-		for (cardx = 0; cardx < 40; ++cardx) {
-			/* 1 = upper nibble of video ram */
-			colors[1] = c64colors[(video[cardy][cardx]>>4) & 0x0f];
-			/* 2 = lower nibble of video ram */
-			colors[2] = c64colors[(video[cardy][cardx]) & 0x0f];
-			/* 3 = color ram */
-			colors[3] = c64colors[(color[cardy][cardx]) & 0x0f];
-			
-			for (y = 0; y < 8; ++y) {
-				int outx = cardx;
-				int outy = 8*cardy+y;
-				
-				int b, c;
-				c = bitmap[cardy][cardx][y];
-				outbitmap[outy][outx] = c;
-				for (b = 0; b < 8; b += 2) {
-					outcolor = colors[(c>>b) & 03];
-					outimage[outy][4*outx+(6-b)/2] = outcolor;
-				}
+	render_outputs(conv, koala, streaming);
+	if (streaming) {
+		conv->loaded = koala;
+		return 0;
+	}
+	unload_koala(conv);
+	return 0;
+}
+
+/*
+ * Standard output is shared by all threads and written in input order. It is
+ * written in large blocks rather than an image at a time, so one reader at the
+ * other end of a pipe can take a whole batch of images in few reads.
+ */
+#define STDOUT_BLOCK (1 << 20)
+pthread_mutex_t stdout_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stdout_turn = PTHREAD_COND_INITIALIZER;
+int stdout_next = 0;
+
+void buffer_stdout(void)
+{
+	char *buf = malloc(STDOUT_BLOCK);
+	if (!buf || setvbuf(stdout, buf, _IOFBF, STDOUT_BLOCK)) {
+		fprintf(stderr, "%s: out of memory\n", argv0);
+		exit(1);
+	}
+}
+
+/* write out what is left of standard output. Returns nonzero on failure. */
+int flush_stdout(void)
+{
+	if (fflush(stdout)) {
+		fprintf(stderr, "%s: could not write output\n", argv0);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Set conv->outfilename to output number i for input number n. Returns
+ * nonzero on failure.
+ */
+int output_filename(struct converter *conv, const char *koalafilename, int n,
+                    int i)
+{
+	if (expand_template(conv->outfilename, sizeof(conv->outfilename),
+	                    outputs[i].template, koalafilename, n,
+	                    c64koala_preset_name(outputs[i].colors.preset))) {
+		fprintf(stderr, "%s: output filename for \"%s\" is too long\n", argv0, koalafilename ? koalafilename : "-");
+		return -1;
+	}
+	return 0;
+}
+
+/* write output number i to outfile. Returns nonzero on failure. */
+int put_image(struct converter *conv, int i, FILE *outfile)
+{
+	struct c64koala_output output;
+	
+	if (conv->loaded && streamed(i)) {
+		get_output(i, palettes[i], &output);
+		return c64koala_stream_image(&ctx, &output, conv->loaded, outfile);
+	}
+	return fwrite(conv->out[i], conv->outlen[i], 1, outfile) != 1;
+}
+
+/*
+ * Write output number i of input number n to the file named by its template.
+ * Returns nonzero on failure.
+ */
+int write_file(struct converter *conv, const char *koalafilename, int n, int i)
+{
+	FILE *outfile;
+	int ret = 0;
+	
+	if (output_filename(conv, koalafilename, n, i))
+		return -1;
+	outfile = fopen(conv->outfilename, "wb");
+	if (!outfile) {
+		fprintf(stderr, "%s: could not open \"%s\" for writing\n", argv0, conv->outfilename);
+		return -1;
+	}
+	if (conv->filebuf)
+		setvbuf(outfile, conv->filebuf, _IOFBF, FILE_BLOCK);
+	if (put_image(conv, i, outfile))
+		ret = -1;
+	if (fclose(outfile))
+		ret = -1;
+	if (ret)
+		fprintf(stderr, "%s: could not write \"%s\"\n", argv0, conv->outfilename);
+	return ret;
+}
+
+/*
+ * Write every output of the converted input number n to the file named by its
+ * template or, without -o, to standard output once all earlier inputs have
+ * been written. A failed conversion (ok == 0) writes nothing but still gives
+ * up its turn. Returns nonzero on failure.
+ */
+int write_output(struct converter *conv, const char *koalafilename, int n, int ok)
+{
+	int i, ret = 0;
+	
+	if (!to_stdout) {
+		if (!ok)
+			return -1;
+		for (i = 0; i < noutputs; ++i)
+			if (write_file(conv, koalafilename, n, i))
+				ret = -1;
+		return ret;
+	}
+	
+	pthread_mutex_lock(&stdout_lock);
+	while (stdout_next != n)
+		pthread_cond_wait(&stdout_turn, &stdout_lock);
+	for (i = 0; ok && i < noutputs; ++i) {
+		if (put_image(conv, i, stdout)) {
+			fprintf(stderr, "%s: could not write output\n", argv0);
+			ret = -1;
+			break;
+		}
+	}
+	++stdout_next;
+	pthread_cond_broadcast(&stdout_turn);
+	pthread_mutex_unlock(&stdout_lock);
+	return ok ? ret : -1;
+}
+
+/* write_output(), then let go of the input that -S streamed from */
+int write_image(struct converter *conv, const char *koalafilename, int n, int ok)
+{
+	int ret = write_output(conv, koalafilename, n, ok);
+	unload_koala(conv);
+	return ret;
+}
+
+/*
+ * Input files are dealt out round-robin to per-worker queues. A worker takes
+ * files from the front of its own queue and, once that is empty, steals from
+ * the front of the other workers' queues. Since every worker is then always
+ * busy with a file that comes before everything left in its own queue, the
+ * earliest unwritten file is always either being converted or at the front of
+ * an idle worker's queue, so waiting for our turn on standard output can never
+ * deadlock, and at most one converted image per worker is ever held back.
+ */
+struct file_queue {
+	pthread_mutex_t lock;
+	int *files;
+	int head, tail;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	struct file_queue queue;
+	struct converter *conv;
+	int converted, stolen, failed;
+	double seconds;
+};
+
+struct worker *workers;
+int nworkers;
+
+int take_file(struct file_queue *queue)
+{
+	int n = -1;
+	pthread_mutex_lock(&queue->lock);
+	if (queue->head < queue->tail)
+		n = queue->files[queue->head++];
+	pthread_mutex_unlock(&queue->lock);
+	return n;
+}
+
+/* returns the next input number for worker w to convert, or -1 when done */
+int next_file(struct worker *w)
+{
+	int i, n;
+	n = take_file(&w->queue);
+	for (i = 1; n < 0 && i < nworkers; ++i) {
+		n = take_file(&workers[(w->id + i) % nworkers].queue);
+		if (n >= 0)
+			++w->stolen;
+	}
+	return n;
+}
+
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *run_worker(void *arg)
+{
+	struct worker *w = arg;
+	double start = now();
+	int n, ok;
+	
+	while ((n = next_file(w)) >= 0) {
+		ok = !convert(w->conv, koalafilenames[n]);
+		if (write_image(w->conv, koalafilenames[n], n, ok))
+			++w->failed;
+		else
+			++w->converted;
+	}
+	w->seconds = now() - start;
+	return NULL;
+}
+
+#ifdef HAVE_IO_URING
+/*
+ * With -u, a single thread keeps up to URING_FILES files in flight through
+ * io_uring: opening, reading and closing the inputs and opening, writing and
+ * closing the outputs are all queued to the kernel in batches, and the thread
+ * only blocks when it has nothing to do but wait for the next completion.
+ * Decoding is cheap next to that many small-file system calls, so the one
+ * thread is enough to keep the ring busy.
+ *
+ * Every file in flight holds a converter with whole images for all outputs,
+ * so with large outputs fewer files are kept in flight, to stay within about
+ * URING_MEMORY but never below URING_MIN_FILES. Input number n always uses
+ * slot n % nfiles, so with output on standard output the slots finish in
+ * input order by construction.
+ */
+#define URING_FILES 128
+#define URING_MIN_FILES 2
+#define URING_MEMORY (64 << 20)
+
+struct uring {
+	int fd;
+	unsigned entries, to_submit;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+};
+
+void uring_free(struct uring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+/* set up a ring with room for entries requests. Returns nonzero on failure. */
+int uring_init(struct uring *ring, unsigned entries)
+{
+	struct io_uring_params p;
+	
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -1;
+	/* IORING_OP_OPENAT, _READ, _WRITE and _CLOSE came with this, in 5.6 */
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(ring->fd);
+		return -1;
+	}
+	
+	ring->entries = p.sq_entries;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	                  PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	                  ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+	    ring->sqes == MAP_FAILED) {
+		uring_free(ring);
+		return -1;
+	}
+	
+	ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+	ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)((char *)ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+	ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+	ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)((char *)ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + p.cq_off.cqes);
+	return 0;
+}
+
+/*
+ * Submit the queued requests and, if wait is set, wait for at least one
+ * completion. Returns nonzero on failure.
+ */
+int uring_enter(struct uring *ring, int wait)
+{
+	int n;
+	do {
+		n = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+		            wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0,
+		            NULL, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -1;
+	ring->to_submit -= n;
+	return 0;
+}
+
+/*
+ * Queue a request. Nothing is submitted before the next uring_enter(), which
+ * is what lets the request be filled in after it is published here.
+ */
+struct io_uring_sqe *uring_sqe(struct uring *ring, int op, int fd,
+                               __u64 user_data)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *ring->sq_tail;
+	
+	if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->entries)
+		uring_enter(ring, 0);
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = user_data;
+	ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++ring->to_submit;
+	return sqe;
+}
+
+/* take the next completion, if there is one */
+int uring_cqe(struct uring *ring, __u64 *user_data, int *res)
+{
+	unsigned head = *ring->cq_head;
+	struct io_uring_cqe *cqe;
+	
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+	cqe = &ring->cqes[head & *ring->cq_mask];
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+enum {
+	SLOT_FREE,
+	SLOT_OPEN_IN,
+	SLOT_READ,
+	SLOT_READY, /* read and waiting for its turn on standard output */
+	SLOT_OPEN_OUT,
+	SLOT_WRITE,
+	SLOT_CLOSE_OUT
+};
+
+struct uring_slot {
+	struct converter *conv;
+	int state, n, fd, ok;
+	int out, out_ok; /* the output being written and whether that went well */
+	size_t done; /* bytes read from the input or written to the output */
+};
+
+struct uring_batch {
+	struct uring ring;
+	struct uring_slot slots[URING_FILES];
+	int nfiles; /* how many of the slots are used */
+	int converted, failed;
+};
+
+/* user_data is the slot number + 1; 0 marks requests nobody waits for */
+#define SLOT_DATA(b, slot) ((__u64)((slot) - (b)->slots) + 1)
+
+void uring_read(struct uring_batch *b, struct uring_slot *slot)
+{
+	struct io_uring_sqe *sqe;
+	sqe = uring_sqe(&b->ring, IORING_OP_READ, slot->fd, SLOT_DATA(b, slot));
+	sqe->addr = (unsigned long)&slot->conv->koala + slot->done;
+	sqe->len = sizeof(struct c64koala) - slot->done;
+	/* standard input may be a pipe, so read it at its current position */
+	sqe->off = slot->fd == STDIN_FILENO ? (__u64)-1 : slot->done;
+	slot->state = SLOT_READ;
+}
+
+void uring_write(struct uring_batch *b, struct uring_slot *slot)
+{
+	struct io_uring_sqe *sqe;
+	sqe = uring_sqe(&b->ring, IORING_OP_WRITE, slot->fd, SLOT_DATA(b, slot));
+	sqe->addr = (unsigned long)slot->conv->out[slot->out] + slot->done;
+	sqe->len = slot->conv->outlen[slot->out] - slot->done;
+	sqe->off = slot->done;
+	slot->state = SLOT_WRITE;
+}
+
+void uring_finish(struct uring_batch *b, struct uring_slot *slot, int ok)
+{
+	if (ok)
+		++b->converted;
+	else
+		++b->failed;
+	slot->state = SLOT_FREE;
+}
+
+void uring_start(struct uring_batch *b, struct uring_slot *slot, int n)
+{
+	struct io_uring_sqe *sqe;
+	
+	slot->n = n;
+	slot->ok = 1;
+	slot->done = 0;
+	c64koala_mark_short(&slot->conv->koala);
+	if (!koalafilenames[n]) {
+		slot->fd = STDIN_FILENO;
+		uring_read(b, slot);
+		return;
+	}
+	sqe = uring_sqe(&b->ring, IORING_OP_OPENAT, AT_FDCWD, SLOT_DATA(b, slot));
+	sqe->addr = (unsigned long)koalafilenames[n];
+	sqe->open_flags = O_RDONLY;
+	slot->state = SLOT_OPEN_IN;
+}
+
+void uring_open_out(struct uring_batch *b, struct uring_slot *slot);
+
+/* queue the next output, or finish once they are all written */
+void uring_next_out(struct uring_batch *b, struct uring_slot *slot)
+{
+	if (++slot->out < noutputs)
+		uring_open_out(b, slot);
+	else
+		uring_finish(b, slot, slot->ok);
+}
+
+void uring_open_out(struct uring_batch *b, struct uring_slot *slot)
+{
+	struct io_uring_sqe *sqe;
+	
+	if (output_filename(slot->conv, koalafilenames[slot->n], slot->n, slot->out)) {
+		slot->ok = 0;
+		uring_next_out(b, slot);
+		return;
+	}
+	sqe = uring_sqe(&b->ring, IORING_OP_OPENAT, AT_FDCWD, SLOT_DATA(b, slot));
+	sqe->addr = (unsigned long)slot->conv->outfilename;
+	sqe->len = 0666;
+	sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+	slot->out_ok = 1;
+	slot->state = SLOT_OPEN_OUT;
+}
+
+/* the input of slot has been read; decode it and queue its outputs */
+void uring_convert(struct uring_batch *b, struct uring_slot *slot)
+{
+	if (slot->ok) {
+		render_outputs(slot->conv, &slot->conv->koala, 0);
+	}
+	if (to_stdout) {
+		uring_finish(b, slot, !write_image(slot->conv, koalafilenames[slot->n],
+		                                   slot->n, slot->ok));
+		return;
+	}
+	if (!slot->ok) {
+		uring_finish(b, slot, 0);
+		return;
+	}
+	slot->out = 0;
+	uring_open_out(b, slot);
+}
+
+/* move slot on to its next step, now that its last request returned res */
+void uring_advance(struct uring_batch *b, struct uring_slot *slot, int res)
+{
+	const char *koalafilename = koalafilenames[slot->n];
+	
+	switch (slot->state) {
+	case SLOT_OPEN_IN:
+		if (res < 0) {
+			fprintf(stderr, "%s: could not open \"%s\" for reading\n", argv0, koalafilename);
+			slot->ok = 0;
+			slot->state = SLOT_READY;
+			break;
+		}
+		slot->fd = res;
+		uring_read(b, slot);
+		break;
+	case SLOT_READ:
+		if (res > 0) {
+			slot->done += res;
+			if (slot->done < sizeof(struct c64koala)) {
+				uring_read(b, slot);
+				break;
+			}
+		} else {
+			warn_short_koala(koalafilename);
+		}
+		if (slot->fd != STDIN_FILENO)
+			uring_sqe(&b->ring, IORING_OP_CLOSE, slot->fd, 0);
+		slot->state = SLOT_READY;
+		break;
+	case SLOT_OPEN_OUT:
+		if (res < 0) {
+			fprintf(stderr, "%s: could not open \"%s\" for writing\n", argv0, slot->conv->outfilename);
+			slot->ok = 0;
+			uring_next_out(b, slot);
+			break;
+		}
+		slot->fd = res;
+		slot->done = 0;
+		uring_write(b, slot);
+		break;
+	case SLOT_WRITE:
+		if (res > 0) {
+			slot->done += res;
+			if (slot->done < slot->conv->outlen[slot->out]) {
+				uring_write(b, slot);
+				break;
 			}
+		} else {
+			slot->out_ok = 0;
+		}
+		uring_sqe(&b->ring, IORING_OP_CLOSE, slot->fd, SLOT_DATA(b, slot));
+		slot->state = SLOT_CLOSE_OUT;
+		break;
+	case SLOT_CLOSE_OUT:
+		if (res < 0 || !slot->out_ok) {
+			fprintf(stderr, "%s: could not write \"%s\"\n", argv0, slot->conv->outfilename);
+			slot->ok = 0;
+		}
+		uring_next_out(b, slot);
+		break;
+	}
+}
+
+/* how many files to keep in flight with the outputs asked for */
+int uring_files(void)
+{
+	struct c64koala_output output;
+	size_t size = sizeof(struct converter), files;
+	int i;
+	
+	for (i = 0; i < noutputs; ++i) {
+		get_output(i, NULL, &output);
+		size += c64koala_output_size(&output);
+	}
+	files = URING_MEMORY / size;
+	if (files < URING_MIN_FILES)
+		return URING_MIN_FILES;
+	return files < URING_FILES ? files : URING_FILES;
+}
+
+/*
+ * Convert all the input files through io_uring. Returns the number of files
+ * that failed, or -1 if io_uring is not available.
+ */
+int run_uring(void)
+{
+	struct uring_batch *b;
+	struct uring_slot *slot;
+	double start = now(), elapsed;
+	int i, n = 0, next_ready = 0, res, ret = 0;
+	__u64 user_data;
+	
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return -1;
+	/* each slot has at most two requests queued: an input close and one more */
+	if (uring_init(&b->ring, 2 * URING_FILES)) {
+		free(b);
+		return -1;
+	}
+	b->nfiles = uring_files();
+	
+	for (;;) {
+		/* keep the ring full */
+		while (n < nkoalafiles) {
+			slot = &b->slots[n % b->nfiles];
+			if (slot->state != SLOT_FREE)
+				break;
+			if (!slot->conv)
+				slot->conv = new_converter();
+			uring_start(b, slot, n++);
+		}
+		
+		/* hand over the files that have been read, in input order */
+		while (next_ready < n) {
+			slot = &b->slots[next_ready % b->nfiles];
+			if (slot->state != SLOT_READY || slot->n != next_ready)
+				break;
+			uring_convert(b, slot);
+			++next_ready;
 		}
+		
+		if (b->converted + b->failed == nkoalafiles)
+			break;
+		if (uring_enter(&b->ring, 1)) {
+			fprintf(stderr, "%s: io_uring_enter failed\n", argv0);
+			exit(1);
+		}
+		while (uring_cqe(&b->ring, &user_data, &res))
+			if (user_data)
+				uring_advance(b, &b->slots[user_data - 1], res);
 	}
 	
-	printf("P6\n"
-	       "%d %d\n"
-	       "%d\n", 160, 200, 255);
-	for (y = 0; y < 200; ++y) {
-		for (x = 0; x < 160; ++x) {
-			printf("%c%c%c",
-			        outimage[y][x].r,
-			        outimage[y][x].g,
-			        outimage[y][x].b);
+	elapsed = now() - start;
+	if (verbose)
+		fprintf(stderr, "%s: io_uring: %d files, %d failed, %.3f s, %.0f files/s\n",
+		        argv0, b->converted, b->failed, elapsed,
+		        elapsed > 0 ? b->converted / elapsed : 0);
+	ret = b->failed;
+	for (i = 0; i < URING_FILES; ++i)
+		free_converter(b->slots[i].conv);
+	uring_enter(&b->ring, 0);
+	uring_free(&b->ring);
+	free(b);
+	return ret;
+}
+#else
+int run_uring(void)
+{
+	return -1;
+}
+#endif
+
+/* look up the palette of each output in the shared cache */
+void get_palettes(void)
+{
+	int i;
+	for (i = 0; i < noutputs; ++i) {
+		palettes[i] = c64koala_palette_get(&palette_cache, &outputs[i].colors);
+		if (!palettes[i]) {
+			c64koala_make_palette(&own_palettes[i], &outputs[i].colors);
+			palettes[i] = &own_palettes[i];
 		}
 	}
-	return 0;
+}
+
+/* with -v, report how often the palette cache saved computing a palette */
+void print_palette_stats(void)
+{
+	unsigned long hits, misses;
+	if (!verbose)
+		return;
+	c64koala_palette_cache_stats(&palette_cache, &hits, &misses);
+	fprintf(stderr, "%s: palette cache: %lu hits, %lu misses\n",
+	        argv0, hits, misses);
+}
+
+int main(int argc, char *argv[])
+{
+	int i, n, converted = 0, failed = 0;
+	double start, elapsed;
+	
+	argv0 = argv[0];
+	getargs(argc, argv);
+	check_output_names();
+	if (to_stdout)
+		buffer_stdout();
+	
+	c64koala_init(&ctx);
+	c64koala_palette_cache_init(&palette_cache);
+	get_palettes();
+	
+	if (use_uring) {
+		failed = run_uring();
+		if (failed >= 0) {
+			if (to_stdout && flush_stdout())
+				failed = 1;
+			print_palette_stats();
+			return failed ? -1 : 0;
+		}
+		failed = 0;
+		if (verbose)
+			fprintf(stderr, "%s: io_uring is not available, using threads\n", argv0);
+	}
+	
+	nworkers = nthreads ? nthreads : sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers > nkoalafiles)
+		nworkers = nkoalafiles;
+	if (nworkers < 1)
+		nworkers = 1;
+	workers = calloc(nworkers, sizeof(*workers));
+	if (!workers) {
+		fprintf(stderr, "%s: out of memory\n", argv0);
+		return 1;
+	}
+	for (i = 0; i < nworkers; ++i) {
+		struct worker *w = &workers[i];
+		w->id = i;
+		pthread_mutex_init(&w->queue.lock, NULL);
+		w->queue.files = malloc((nkoalafiles / nworkers + 1) * sizeof(int));
+		w->conv = new_converter();
+		if (!w->queue.files) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			return 1;
+		}
+		for (n = i; n < nkoalafiles; n += nworkers)
+			w->queue.files[w->queue.tail++] = n;
+	}
+	
+	start = now();
+	if (nworkers == 1) {
+		run_worker(&workers[0]);
+	} else {
+		for (i = 0; i < nworkers; ++i) {
+			if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) {
+				fprintf(stderr, "%s: could not start thread\n", argv0);
+				return 1;
+			}
+		}
+		for (i = 0; i < nworkers; ++i)
+			pthread_join(workers[i].thread, NULL);
+	}
+	elapsed = now() - start;
+	
+	for (i = 0; i < nworkers; ++i) {
+		struct worker *w = &workers[i];
+		if (verbose)
+			fprintf(stderr, "%s: thread %d: %d files (%d stolen), %d failed, %.3f s, %.0f files/s\n",
+			        argv0, i, w->converted, w->stolen, w->failed,
+			        w->seconds, w->seconds > 0 ? w->converted / w->seconds : 0);
+		converted += w->converted;
+		failed += w->failed;
+		free(w->queue.files);
+		free_converter(w->conv);
+	}
+	if (verbose)
+		fprintf(stderr, "%s: total: %d files, %d failed, %.3f s, %.0f files/s\n",
+		        argv0, converted, failed, elapsed,
+		        elapsed > 0 ? converted / elapsed : 0);
+	free(workers);
+	if (to_stdout && flush_stdout())
+		failed = 1;
+	print_palette_stats();
+	return failed ? -1 : 0;
 }
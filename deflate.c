@@ -0,0 +1,547 @@
+/*
+
+$Id$
+
+libc64koala, decode Commodore 64 KoalaPaint images
+Copyright 2009 Christopher Williams
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#include "deflate.h"
+
+/*
+ * This is a plain LZ77 + Huffman deflate, as in RFC 1951. Matches are found
+ * through hash chains over a 32K window. The fast level takes the first good
+ * enough match on a short chain; the thorough level searches much longer
+ * chains and defers a match by one byte when that finds a longer one. Every
+ * block is written whichever way is smallest: stored, with the fixed codes,
+ * or with its own Huffman codes.
+ */
+
+#define WSIZE 32768
+#define MIN_MATCH 3
+#define MAX_MATCH 258
+#define HASH_BITS 14
+#define BLOCK_SYMS 16384
+
+/* base and extra bits of each length code from 257, and each distance code */
+static const unsigned short len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const unsigned char len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const unsigned short dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577
+};
+static const unsigned char dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* the order the code length code's lengths are sent in */
+static const unsigned char clen_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+struct deflate_state {
+	/* the latest position + 1 with each hash, 0 if none */
+	int head[1 << HASH_BITS];
+	/* how far back the previous position with the same hash is, 0 if none */
+	unsigned short prev[WSIZE];
+	/* the current block: literals as 0..255, matches as 256 + length - 3 */
+	unsigned short litlen[BLOCK_SYMS];
+	unsigned short dist[BLOCK_SYMS];
+};
+
+size_t c64koala_zlib_scratch_size(void)
+{
+	return sizeof(struct deflate_state);
+}
+
+struct bits {
+	unsigned char *out;
+	size_t len;
+	uint64_t buf;
+	int n;
+};
+
+static void put_bits(struct bits *b, unsigned value, int n)
+{
+	b->buf |= (uint64_t)value << b->n;
+	b->n += n;
+	while (b->n >= 8) {
+		b->out[b->len++] = b->buf;
+		b->buf >>= 8;
+		b->n -= 8;
+	}
+}
+
+/* pad to a whole byte */
+static void flush_bits(struct bits *b)
+{
+	if (b->n > 0)
+		b->out[b->len++] = b->buf;
+	b->buf = 0;
+	b->n = 0;
+}
+
+/* the length code (less 257) for a match of len bytes */
+static int len_code(int len)
+{
+	int x = len - 3, n;
+	if (len == MAX_MATCH)
+		return 28;
+	if (x < 8)
+		return x;
+	n = 31 - __builtin_clz(x);
+	return 4*(n - 1) + ((x >> (n - 2)) & 3);
+}
+
+static int dist_code(int dist)
+{
+	int x = dist - 1, n;
+	if (x < 4)
+		return x;
+	n = 31 - __builtin_clz(x);
+	return 2*n + ((x >> (n - 1)) & 1);
+}
+
+/*
+ * Work out the Huffman code lengths, at most maxbits, for the n symbols with
+ * frequencies freq[] into lens[]. Symbols that never occur get no code. If the
+ * tree comes out too deep, the frequencies are flattened until it fits.
+ */
+static void huffman_lengths(const unsigned *freq, int n, int maxbits,
+                            unsigned char *lens)
+{
+	unsigned weight[2*288];
+	int sym[288], parent[2*288], depth[2*288];
+	int i, j, m = 0, leaf, node, next, a, b, deepest;
+	
+	memset(lens, 0, n);
+	for (i = 0; i < n; ++i) {
+		if (!freq[i])
+			continue;
+		/* insertion sort by frequency */
+		for (j = m++; j > 0 && freq[sym[j-1]] > freq[i]; --j)
+			sym[j] = sym[j-1];
+		sym[j] = i;
+	}
+	if (m == 1)
+		lens[sym[0]] = 1;
+	if (m < 2)
+		return;
+	for (i = 0; i < m; ++i)
+		weight[i] = freq[sym[i]];
+	
+	for (;;) {
+		/* leaves and then new nodes both come in order of weight */
+		leaf = 0;
+		node = m;
+		for (next = m; next < 2*m - 1; ++next) {
+			a = leaf < m && (node >= next || weight[leaf] <= weight[node]) ? leaf++ : node++;
+			b = leaf < m && (node >= next || weight[leaf] <= weight[node]) ? leaf++ : node++;
+			parent[a] = parent[b] = next;
+			weight[next] = weight[a] + weight[b];
+		}
+		depth[2*m - 2] = 0;
+		deepest = 0;
+		for (i = 2*m - 3; i >= 0; --i) {
+			depth[i] = depth[parent[i]] + 1;
+			if (depth[i] > deepest)
+				deepest = depth[i];
+		}
+		if (deepest <= maxbits)
+			break;
+		for (i = 0; i < m; ++i)
+			weight[i] = (weight[i] >> 1) | 1;
+	}
+	for (i = 0; i < m; ++i)
+		lens[sym[i]] = depth[i];
+}
+
+/* the canonical codes for lens[], bit reversed as deflate sends them */
+static void huffman_codes(const unsigned char *lens, int n,
+                          unsigned short *codes)
+{
+	int count[16] = { 0 }, next[16];
+	int i, bits, code = 0, c, r;
+	
+	for (i = 0; i < n; ++i)
+		++count[lens[i]];
+	count[0] = 0;
+	for (bits = 1; bits < 16; ++bits) {
+		code = (code + count[bits-1]) << 1;
+		next[bits] = code;
+	}
+	for (i = 0; i < n; ++i) {
+		if (!lens[i])
+			continue;
+		c = next[lens[i]]++;
+		for (r = 0, bits = 0; bits < lens[i]; ++bits, c >>= 1)
+			r = r << 1 | (c & 1);
+		codes[i] = r;
+	}
+}
+
+/* one block's symbol counts and codes */
+struct block {
+	unsigned lfreq[286], dfreq[30];
+	unsigned char llen[288], dlen[30];
+	unsigned short lcode[288], dcode[30];
+	/* the run-length coded code lengths of a dynamic block */
+	int hlit, hdist, hclen, nrle;
+	unsigned char rle[286 + 30], rle_extra[286 + 30];
+	unsigned cfreq[19];
+	unsigned char clen[19];
+	unsigned short ccode[19];
+};
+
+/* the bits the block's symbols take with the given code lengths */
+static size_t data_bits(const struct block *k, const unsigned char *llen,
+                        const unsigned char *dlen)
+{
+	size_t bits = 0;
+	int i;
+	for (i = 0; i < 286; ++i)
+		bits += (size_t)k->lfreq[i] * llen[i];
+	for (i = 0; i < 29; ++i)
+		bits += (size_t)k->lfreq[257 + i] * len_extra[i];
+	for (i = 0; i < 30; ++i)
+		bits += (size_t)k->dfreq[i] * (dlen[i] + dist_extra[i]);
+	return bits;
+}
+
+static void add_rle(struct block *k, int sym, int extra)
+{
+	k->rle[k->nrle] = sym;
+	k->rle_extra[k->nrle++] = extra;
+	++k->cfreq[sym];
+}
+
+/* build the block's own codes. Returns the bits the block would take. */
+static size_t dynamic_codes(struct block *k)
+{
+	unsigned char all[286 + 30];
+	size_t bits;
+	int i, n, run, r, used;
+	
+	/* the literal/length code must be complete too */
+	for (used = 0, i = 0; i < 286; ++i)
+		used += k->lfreq[i] != 0;
+	for (i = 0; used < 2; ++i)
+		if (!k->lfreq[i]++)
+			++used;
+	huffman_lengths(k->lfreq, 286, 15, k->llen);
+	k->llen[286] = k->llen[287] = 0;
+	huffman_lengths(k->dfreq, 30, 15, k->dlen);
+	/* a lone distance code still needs a length; no distances need one too */
+	for (used = 0, i = 0; i < 30; ++i)
+		used += k->dlen[i] != 0;
+	if (!used)
+		k->dlen[0] = 1;
+	for (k->hlit = 286; k->hlit > 257 && !k->llen[k->hlit-1]; --k->hlit)
+		;
+	for (k->hdist = 30; k->hdist > 1 && !k->dlen[k->hdist-1]; --k->hdist)
+		;
+	
+	n = k->hlit + k->hdist;
+	memcpy(all, k->llen, k->hlit);
+	memcpy(all + k->hlit, k->dlen, k->hdist);
+	memset(k->cfreq, 0, sizeof(k->cfreq));
+	k->nrle = 0;
+	for (i = 0; i < n; ) {
+		for (run = 1; i + run < n && all[i + run] == all[i]; ++run)
+			;
+		if (!all[i] && run >= 3) {
+			r = run < 138 ? run : 138;
+			if (r >= 11)
+				add_rle(k, 18, r - 11);
+			else
+				add_rle(k, 17, r - 3);
+			i += r;
+		} else if (all[i] && run >= 4) {
+			add_rle(k, all[i], 0);
+			for (++i, --run; run >= 3; i += r, run -= r) {
+				r = run < 6 ? run : 6;
+				add_rle(k, 16, r - 3);
+			}
+		} else {
+			add_rle(k, all[i++], 0);
+		}
+	}
+	/* the code length code must be complete, so give it two codes at least */
+	for (used = 0, i = 0; i < 19; ++i)
+		used += k->cfreq[i] != 0;
+	for (i = 0; used < 2; ++i)
+		if (!k->cfreq[i]++)
+			++used;
+	huffman_lengths(k->cfreq, 19, 7, k->clen);
+	for (k->hclen = 19; k->hclen > 4 && !k->clen[clen_order[k->hclen-1]]; --k->hclen)
+		;
+	
+	bits = 5 + 5 + 4 + 3*k->hclen;
+	for (i = 0; i < 19; ++i)
+		bits += (size_t)k->cfreq[i] * k->clen[i];
+	bits += 2*k->cfreq[16] + 3*k->cfreq[17] + 7*k->cfreq[18];
+	return bits + data_bits(k, k->llen, k->dlen);
+}
+
+static void fixed_lengths(unsigned char *llen, unsigned char *dlen)
+{
+	int i;
+	for (i = 0; i < 288; ++i)
+		llen[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+	for (i = 0; i < 30; ++i)
+		dlen[i] = 5;
+}
+
+static void write_symbols(const struct deflate_state *st, struct bits *b,
+                          const struct block *k, int nsyms)
+{
+	int i, len, dist, c;
+	for (i = 0; i < nsyms; ++i) {
+		if (st->litlen[i] < 256) {
+			put_bits(b, k->lcode[st->litlen[i]], k->llen[st->litlen[i]]);
+			continue;
+		}
+		len = st->litlen[i] - 256 + MIN_MATCH;
+		c = len_code(len);
+		put_bits(b, k->lcode[257 + c], k->llen[257 + c]);
+		put_bits(b, len - len_base[c], len_extra[c]);
+		dist = st->dist[i];
+		c = dist_code(dist);
+		put_bits(b, k->dcode[c], k->dlen[c]);
+		put_bits(b, dist - dist_base[c], dist_extra[c]);
+	}
+	put_bits(b, k->lcode[256], k->llen[256]);
+}
+
+/* write out the block of nsyms symbols that covers raw[0..len-1] */
+static void write_block(const struct deflate_state *st, struct bits *b,
+                        const unsigned char *raw, size_t len, int nsyms,
+                        int last)
+{
+	struct block k;
+	unsigned char fixed_llen[288], fixed_dlen[30];
+	size_t dynamic, fixed, stored, chunk;
+	int i;
+	
+	memset(k.lfreq, 0, sizeof(k.lfreq));
+	memset(k.dfreq, 0, sizeof(k.dfreq));
+	for (i = 0; i < nsyms; ++i) {
+		if (st->litlen[i] < 256) {
+			++k.lfreq[st->litlen[i]];
+		} else {
+			++k.lfreq[257 + len_code(st->litlen[i] - 256 + MIN_MATCH)];
+			++k.dfreq[dist_code(st->dist[i])];
+		}
+	}
+	k.lfreq[256] = 1;
+	
+	dynamic = 3 + dynamic_codes(&k);
+	stored = (len + 5 * (len / 65535 + 1)) * 8 + 7;
+	fixed_lengths(fixed_llen, fixed_dlen);
+	fixed = 3 + data_bits(&k, fixed_llen, fixed_dlen);
+	
+	if (stored < dynamic && stored < fixed) {
+		do {
+			chunk = len < 65535 ? len : 65535;
+			len -= chunk;
+			put_bits(b, last && !len, 1);
+			put_bits(b, 0, 2);
+			flush_bits(b);
+			b->out[b->len++] = chunk;
+			b->out[b->len++] = chunk >> 8;
+			b->out[b->len++] = ~chunk;
+			b->out[b->len++] = ~chunk >> 8;
+			memcpy(b->out + b->len, raw, chunk);
+			b->len += chunk;
+			raw += chunk;
+		} while (len);
+		return;
+	}
+	
+	put_bits(b, last, 1);
+	if (fixed <= dynamic) {
+		put_bits(b, 1, 2);
+		memcpy(k.llen, fixed_llen, sizeof(k.llen));
+		memcpy(k.dlen, fixed_dlen, sizeof(k.dlen));
+	} else {
+		put_bits(b, 2, 2);
+		put_bits(b, k.hlit - 257, 5);
+		put_bits(b, k.hdist - 1, 5);
+		put_bits(b, k.hclen - 4, 4);
+		for (i = 0; i < k.hclen; ++i)
+			put_bits(b, k.clen[clen_order[i]], 3);
+		huffman_codes(k.clen, 19, k.ccode);
+		for (i = 0; i < k.nrle; ++i) {
+			put_bits(b, k.ccode[k.rle[i]], k.clen[k.rle[i]]);
+			if (k.rle[i] >= 16)
+				put_bits(b, k.rle_extra[i], k.rle[i] == 16 ? 2 : k.rle[i] == 17 ? 3 : 7);
+		}
+	}
+	huffman_codes(k.llen, 288, k.lcode);
+	huffman_codes(k.dlen, 30, k.dcode);
+	write_symbols(st, b, &k, nsyms);
+}
+
+static unsigned hash(const unsigned char *p)
+{
+	uint32_t x = p[0] | p[1] << 8 | p[2] << 16;
+	return (x * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void insert(struct deflate_state *st, const unsigned char *in,
+                   size_t pos, size_t len)
+{
+	unsigned h;
+	size_t d = 0;
+	
+	if (pos + MIN_MATCH > len)
+		return;
+	h = hash(in + pos);
+	if (st->head[h])
+		d = pos - (st->head[h] - 1);
+	st->prev[pos & (WSIZE - 1)] = d < WSIZE ? d : 0;
+	st->head[h] = pos + 1;
+}
+
+/*
+ * Find the longest match for the bytes at pos among the last chain positions
+ * with the same hash, stopping early at nice bytes. Returns its length, or 0
+ * if there is none, and its distance in *dist.
+ */
+static int longest_match(const struct deflate_state *st, const unsigned char *in,
+                         size_t pos, size_t len, int chain, int nice,
+                         int *dist)
+{
+	size_t maxlen = len - pos, cur, n, best = 0;
+	unsigned step;
+	int h;
+	
+	if (maxlen < MIN_MATCH)
+		return 0;
+	if (maxlen > MAX_MATCH)
+		maxlen = MAX_MATCH;
+	h = hash(in + pos);
+	if (!st->head[h])
+		return 0;
+	for (cur = st->head[h] - 1; pos - cur < WSIZE; cur -= step) {
+		if (in[cur + best] == in[pos + best]) {
+			for (n = 0; n < maxlen && in[cur + n] == in[pos + n]; ++n)
+				;
+			if (n > best) {
+				best = n;
+				*dist = pos - cur;
+				if (n >= (size_t)nice || n == maxlen)
+					break;
+			}
+		}
+		step = st->prev[cur & (WSIZE - 1)];
+		if (--chain == 0 || !step)
+			break;
+	}
+	return best >= MIN_MATCH ? best : 0;
+}
+
+static uint32_t adler32(const unsigned char *p, size_t len)
+{
+	uint32_t a = 1, b = 0;
+	size_t n;
+	while (len) {
+		n = len < 5552 ? len : 5552;
+		len -= n;
+		while (n--) {
+			a += *p++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return b << 16 | a;
+}
+
+size_t c64koala_zlib_compress(unsigned char *out, const unsigned char *in,
+                              size_t len, int thorough, void *scratch)
+{
+	struct deflate_state *st = scratch;
+	struct bits b;
+	size_t pos = 0, start = 0, i;
+	int chain = thorough ? 1024 : 8, nice = thorough ? MAX_MATCH : 32;
+	int nsyms = 0, mlen, mdist = 0, nlen, ndist;
+	uint32_t adler;
+	
+	memset(st->head, 0, sizeof(st->head));
+	b.out = out;
+	b.len = 0;
+	b.buf = 0;
+	b.n = 0;
+	/* deflate with a 32K window, and the level in the check bits */
+	out[b.len++] = 0x78;
+	out[b.len++] = thorough ? 0xda : 0x01;
+	
+	while (pos < len) {
+		mlen = longest_match(st, in, pos, len, chain, nice, &mdist);
+		if (thorough && mlen && mlen < nice) {
+			/* put off the match if the next byte starts a longer one */
+			insert(st, in, pos, len);
+			nlen = longest_match(st, in, pos + 1, len, chain, nice, &ndist);
+			if (nlen > mlen) {
+				st->litlen[nsyms++] = in[pos++];
+			} else {
+				st->litlen[nsyms] = 256 + mlen - MIN_MATCH;
+				st->dist[nsyms++] = mdist;
+				for (i = 1; i < (size_t)mlen; ++i)
+					insert(st, in, pos + i, len);
+				pos += mlen;
+			}
+		} else if (mlen) {
+			st->litlen[nsyms] = 256 + mlen - MIN_MATCH;
+			st->dist[nsyms++] = mdist;
+			/* the fast level skips most of a long match */
+			for (i = 0; i < (size_t)mlen && (thorough || i < 16); ++i)
+				insert(st, in, pos + i, len);
+			pos += mlen;
+		} else {
+			insert(st, in, pos, len);
+			st->litlen[nsyms++] = in[pos++];
+		}
+		if (nsyms == BLOCK_SYMS) {
+			write_block(st, &b, in + start, pos - start, nsyms, 0);
+			start = pos;
+			nsyms = 0;
+		}
+	}
+	write_block(st, &b, in + start, pos - start, nsyms, 1);
+	flush_bits(&b);
+	
+	adler = adler32(in, len);
+	out[b.len++] = adler >> 24;
+	out[b.len++] = adler >> 16;
+	out[b.len++] = adler >> 8;
+	out[b.len++] = adler;
+	return b.len;
+}
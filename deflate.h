@@ -0,0 +1,49 @@
+/*
+
+$Id$
+
+libc64koala, decode Commodore 64 KoalaPaint images
+Copyright 2009 Christopher Williams
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+/* a small zlib (RFC 1950/1951) compressor, private to libc64koala */
+
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include <stddef.h>
+
+/* kept out of libc64koala.so's exports, which are only the c64koala.h API */
+#define DEFLATE_PRIVATE __attribute__((visibility("hidden")))
+
+/* the most bytes c64koala_zlib_compress() can write for len bytes of input */
+#define C64KOALA_ZLIB_BOUND(len) ((len) + (len) / 1024 + 64)
+
+/* the scratch space c64koala_zlib_compress() needs, suitably aligned */
+DEFLATE_PRIVATE size_t c64koala_zlib_scratch_size(void);
+
+/*
+ * Compress len bytes from in to a zlib stream in out, which must hold
+ * C64KOALA_ZLIB_BOUND(len) bytes. thorough trades speed for size. Returns the
+ * number of bytes written.
+ */
+DEFLATE_PRIVATE
+size_t c64koala_zlib_compress(unsigned char *out, const unsigned char *in,
+                              size_t len, int thorough, void *scratch);
+
+#endif
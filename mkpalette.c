@@ -0,0 +1,48 @@
+/*
+
+$Id$
+
+mkpalette, generate the default libc64koala palette at build time
+Copyright 2009 Christopher Williams
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+
+#include "c64koala.h"
+
+/*
+ * Print c64koala_palette.h, the palette for the default color settings, so
+ * that c64koala_make_palette() can copy it instead of computing it. This is
+ * linked against a c64koala.c built with C64KOALA_NO_DEFAULT_PALETTE, so the
+ * table always matches what the library would compute.
+ */
+int main(void)
+{
+	const struct c64koala_colors colors = C64KOALA_COLORS_DEFAULT;
+	struct c64koala_palette palette;
+	int i;
+	
+	c64koala_make_palette(&palette, &colors);
+	printf("/* generated by mkpalette; do not edit */\n");
+	printf("static const struct c64koala_rgb default_palette[16] = {\n");
+	for (i = 0; i < 16; ++i)
+		printf("\t{ 0x%02x, 0x%02x, 0x%02x },\n",
+		       palette.rgb[i].r, palette.rgb[i].g, palette.rgb[i].b);
+	printf("};\n");
+	return ferror(stdout) || fclose(stdout);
+}